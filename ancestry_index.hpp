@@ -0,0 +1,210 @@
+// Индекс предков: проверка "предок ли", наименьший общий предок, путь до корня
+// Автор Д. Шелемех, 2021
+
+#ifndef SDS_ANCESTRY_INDEX_HPP
+#define SDS_ANCESTRY_INDEX_HPP
+
+#include "node.hpp"
+#include <vector>
+#include <utility>
+#include <string>
+#include <stdexcept>
+
+namespace sds {
+
+    // Структурный индекс дерева, все таблицы индексируются id узла.
+    // Нумерация входа / выхода обхода в глубину дает проверку "предок ли" за O(1),
+    // таблица двоичных подъемов - наименьшего общего предка за O(log h).
+    // Добавление листа обновляет подъемы за O(log h), но портит нумерацию: до вызова renumber()
+    // проверка "предок ли" идет подъемами за O(log h).
+    class AncestryIndex
+    {
+    private:
+        static constexpr std::size_t NONE = static_cast<std::size_t>(-1);
+
+        Node::PointerType root;
+        std::vector<Node::PointerType> nodes;       // узлы по id
+        std::vector<std::size_t> enter;             // номер входа в узел при обходе в глубину
+        std::vector<std::size_t> leave;             // номер выхода из узла
+        std::vector<std::vector<std::size_t>> up;   // up[k][id] - предок на 2^k уровней выше (корень - сам себе)
+        bool numbered;                              // нумерация enter / leave актуальна
+
+        // Добавляет узел в таблицы (родитель уже должен быть в индексе).
+        void place(Node::PointerType const& node, std::size_t parent_id)
+        {
+            std::size_t id = node->getId();
+
+            if(id >= nodes.size()) {
+                nodes.resize(id + 1);
+                enter.resize(id + 1, NONE);
+                leave.resize(id + 1, NONE);
+                for(std::vector<std::size_t>& row: up) {
+                    row.resize(id + 1, NONE);
+                }
+            }
+
+            // высоты дерева больше не хватает таблице подъемов - добавляем строку
+            while((std::size_t(1) << up.size()) <= node->getLevel()) {
+                std::vector<std::size_t> const& prev = up.back();
+                std::vector<std::size_t> row(prev.size(), NONE);
+                for(std::size_t v = 0; v != prev.size(); ++v) {
+                    if(prev[v] != NONE) {
+                        row[v] = prev[prev[v]];
+                    }
+                }
+                up.push_back(std::move(row));
+            }
+
+            nodes[id] = node;
+            up[0][id] = parent_id;
+            for(std::size_t k = 1; k != up.size(); ++k) {
+                up[k][id] = up[k - 1][up[k - 1][id]];
+            }
+        }
+        // Возвращает предка узла на distance уровней выше.
+        std::size_t lift(std::size_t id, std::size_t distance) const
+        {
+            for(std::size_t k = 0; distance; ++k, distance >>= 1) {
+                if(distance & 1) {
+                    id = up[k][id];
+                }
+            }
+            return id;
+        }
+        // Проверяет наличие узла в индексе.
+        void check(std::size_t id) const
+        {
+            if(id >= nodes.size() || !nodes[id]) {
+                std::string msg = "Couldn't find node with ID = " + std::to_string(id);
+                throw std::runtime_error(msg);
+            }
+        }
+
+    public:
+        // Структоры
+        explicit AncestryIndex(Node::PointerType const& root):
+            root(root), nodes(), enter(), leave(), up(1), numbered(false)
+        {
+            // обход в ширину: родитель попадает в индекс раньше потомков
+            std::vector<Node::PointerType> order(1, root);
+            place(root, root->getId());
+            for(std::size_t i = 0; i != order.size(); ++i) {
+                for(Node::PointerType const& kid: order[i]->kids) {
+                    place(kid, order[i]->getId());
+                    order.push_back(kid);
+                }
+            }
+
+            renumber();
+        }
+
+        // Модификаторы
+
+        // Добавляет в индекс новый лист.
+        void addLeaf(Node::PointerType const& node)
+        {
+            place(node, *node->getParent());
+            numbered = false;
+        }
+        // Перенумеровывает узлы обходом в глубину, возвращая проверке "предок ли" время O(1).
+        void renumber()
+        {
+            std::vector<std::pair<Node*, std::size_t>> stack(1, std::make_pair(root.get(), 0));
+            std::size_t clock = 0;
+
+            enter[root->getId()] = clock++;
+            while(!stack.empty()) {
+                std::pair<Node*, std::size_t>& top = stack.back();
+                if(top.second == top.first->kids.size()) {
+                    leave[top.first->getId()] = clock++;
+                    stack.pop_back();
+                    continue;
+                }
+                Node* kid = top.first->kids[top.second++].get();
+                enter[kid->getId()] = clock++;
+                stack.emplace_back(kid, 0);
+            }
+
+            numbered = true;
+        }
+
+        // Запросы
+        bool isNumbered() const noexcept {
+            return numbered;
+        }
+        // Возвращает число байт, занятых таблицами индекса.
+        std::size_t memoryUsage() const noexcept
+        {
+            std::size_t bytes = nodes.capacity() * sizeof(Node::PointerType) +
+                                (enter.capacity() + leave.capacity()) * sizeof(std::size_t);
+            for(std::vector<std::size_t> const& row: up) {
+                bytes += row.capacity() * sizeof(std::size_t);
+            }
+            return bytes;
+        }
+        // Возвращает узел по id или nullptr.
+        Node::PointerType find(std::size_t id) const noexcept {
+            return id < nodes.size() ? nodes[id] : nullptr;
+        }
+        // Является ли ancestor_id предком node_id (узел считается предком самого себя).
+        bool isAncestor(std::size_t ancestor_id, std::size_t node_id) const
+        {
+            check(ancestor_id);
+            check(node_id);
+
+            if(numbered) {
+                return enter[ancestor_id] <= enter[node_id] && leave[node_id] <= leave[ancestor_id];
+            }
+
+            std::size_t ancestor_level = nodes[ancestor_id]->getLevel(), node_level = nodes[node_id]->getLevel();
+            return ancestor_level <= node_level && lift(node_id, node_level - ancestor_level) == ancestor_id;
+        }
+        // Возвращает id наименьшего общего предка двух узлов.
+        std::size_t lca(std::size_t first_id, std::size_t second_id) const
+        {
+            check(first_id);
+            check(second_id);
+
+            std::size_t first_level = nodes[first_id]->getLevel(), second_level = nodes[second_id]->getLevel();
+            if(first_level < second_level) {
+                second_id = lift(second_id, second_level - first_level);
+            }
+            else {
+                first_id = lift(first_id, first_level - second_level);
+            }
+
+            if(first_id == second_id) {
+                return first_id;
+            }
+
+            for(std::size_t k = up.size(); k-- != 0; ) {
+                if(up[k][first_id] != up[k][second_id]) {
+                    first_id = up[k][first_id];
+                    second_id = up[k][second_id];
+                }
+            }
+
+            return up[0][first_id];
+        }
+        // Возвращает путь от узла до корня (включительно).
+        std::vector<Node::PointerType> pathToRoot(std::size_t id) const
+        {
+            check(id);
+
+            std::vector<Node::PointerType> path;
+            path.reserve(nodes[id]->getLevel() + 1);
+            for(;;) {
+                path.push_back(nodes[id]);
+                if(up[0][id] == id) {
+                    break;
+                }
+                id = up[0][id];
+            }
+
+            return path;
+        }
+    };
+
+} // namespace sds
+
+#endif
@@ -1,10 +1,251 @@
 #include "nary_tree.hpp"
 #include "utilities.hpp"
+#include "tree_image.hpp"
 #include <boost/program_options.hpp>
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <filesystem>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <cstdio>
+#include <set>
+#include <vector>
 
 namespace opt = boost::program_options;
+namespace fs = std::filesystem;
+
+namespace {
+
+    // Имя файла, означающее стандартный поток ввода / вывода
+    const std::string STD_STREAM = "-";
+
+    // Задание на конвертацию одного файла
+    struct Job {
+        std::string input;
+        std::string output;
+    };
+
+    // Буфер потока поверх чужого буфера (std::cin / std::cout), считающий прошедшие байты.
+    // Используется в одну сторону: либо для чтения, либо для записи.
+    class CountingBuf: public std::streambuf
+    {
+    private:
+        std::streambuf* target;
+        std::vector<char> buffer;
+        std::size_t count;                      // байт прочитано / записано
+
+        // Отдает накопленные для записи байты в target.
+        bool flushBuffer()
+        {
+            std::streamsize size = pptr() - pbase();
+            if(size && target->sputn(pbase(), size) != size) {
+                return false;
+            }
+            count += static_cast<std::size_t>(size);
+            setp(buffer.data(), buffer.data() + buffer.size());
+            return true;
+        }
+
+    protected:
+        int_type underflow() override
+        {
+            std::streamsize size = target->sgetn(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+            if(size <= 0) {
+                return traits_type::eof();
+            }
+            count += static_cast<std::size_t>(size);
+            setg(buffer.data(), buffer.data(), buffer.data() + size);
+            return traits_type::to_int_type(*gptr());
+        }
+        int_type overflow(int_type ch) override
+        {
+            if(!flushBuffer()) {
+                return traits_type::eof();
+            }
+            if(!traits_type::eq_int_type(ch, traits_type::eof())) {
+                *pptr() = traits_type::to_char_type(ch);
+                pbump(1);
+            }
+            return traits_type::not_eof(ch);
+        }
+        int sync() override {
+            return flushBuffer() && target->pubsync() == 0 ? 0 : -1;
+        }
+
+    public:
+        // Структоры
+        explicit CountingBuf(std::streambuf* target, std::size_t buffer_size = 1 << 16):
+            target(target), buffer(buffer_size), count(0)
+        {
+            setp(buffer.data(), buffer.data() + buffer.size());
+        }
+        CountingBuf(CountingBuf const& ) = delete;
+        CountingBuf& operator=(CountingBuf const& ) = delete;
+        ~CountingBuf() override = default;
+
+        // Запросы
+        std::size_t bytes() const noexcept {
+            return count;
+        }
+    };
+
+    // Итоги конвертации
+    struct Totals {
+        std::size_t files = 0;
+        std::size_t failed = 0;
+        std::size_t nodes = 0;
+        std::size_t bytes_in = 0;
+        std::size_t bytes_out = 0;
+    };
+
+    // Загружает дерево, при необходимости печатает его и сохраняет в выбранном формате.
+    // Аргументы:
+    // job - входной и выходной файлы ("-" - стандартные потоки)
+    // format - формат вывода: sds, sds+idx (с sidecar-индексом снимка) или img (образ для mmap)
+    // print - напечатать дерево на экран
+    // Возвращает:
+    // Totals - итоги по одному файлу
+    Totals convert(Job const& job, std::string const& format, bool print)
+    {
+        Totals totals;
+        sds::NaryTree tree = sds::NaryTree();
+
+        if(job.input == STD_STREAM) {
+            CountingBuf in_buf(std::cin.rdbuf());
+            std::istream in_stream(&in_buf);
+            tree.loadTree(in_stream);
+            totals.bytes_in = in_buf.bytes();
+        }
+        else {
+            sds::loadTreeFromFile(tree, job.input);
+            totals.bytes_in = static_cast<std::size_t>(fs::file_size(job.input));
+        }
+
+        if(print) {
+            if(__linux__ && system("clear"))
+            {
+                throw std::runtime_error("Unable to clear the screen");
+            };
+
+            tree.print();
+        }
+
+        if(format == "img") {
+            if(job.output == STD_STREAM) {
+                throw std::runtime_error("Tree image can't be written to stdout");
+            }
+            sds::TreeImage::publish(tree, job.output);
+            totals.bytes_out = static_cast<std::size_t>(fs::file_size(job.output));
+        }
+        else if(job.output == STD_STREAM) {
+            // отдельный поток поверх буфера std::cout: в него пишется формат файла, а не экранный
+            CountingBuf out_buf(std::cout.rdbuf());
+            std::ostream out_stream(&out_buf);
+            tree.saveTree(out_stream);
+            if(!(out_stream << std::flush)) {
+                throw std::runtime_error("Error while writing to stdout");
+            }
+            totals.bytes_out = out_buf.bytes();
+        }
+        else {
+            sds::saveTreeToFile(tree, job.output, format == "sds+idx");
+            totals.bytes_out = static_cast<std::size_t>(fs::file_size(job.output));
+        }
+
+        totals.files = 1;
+        totals.nodes = tree.getNodesVector().size();
+        return totals;
+    }
+    // Читает манифест пакетной обработки: по строке "входной_файл выходной_файл" на задание.
+    std::vector<Job> readManifest(std::istream& is)
+    {
+        std::vector<Job> jobs;
+        std::string line;
+
+        while(std::getline(is, line)) {
+            std::istringstream iss(line);
+            Job job{"", ""};
+            if(!(iss >> job.input)) {
+                continue;                                   // пустая строка
+            }
+            if(!(iss >> job.output)) {
+                throw std::runtime_error("Manifest line without output file: '" + line + "'");
+            }
+            jobs.push_back(job);
+        }
+
+        return jobs;
+    }
+    // Проверяет задания до запуска пула: два задания не должны писать в один файл, параллельные
+    // задания не могут делить stdin / stdout, а stdin, из которого читается манифест, уже занят.
+    void checkJobs(std::vector<Job> const& jobs, std::size_t jobs_count, bool stdin_busy)
+    {
+        std::set<fs::path> outputs;
+        bool parallel = std::min(jobs_count, jobs.size()) > 1;
+
+        for(Job const& job: jobs) {
+            if(job.input == STD_STREAM && stdin_busy) {
+                throw std::runtime_error("Manifest is read from stdin, so a job can't read its input from stdin");
+            }
+            if(parallel && (job.input == STD_STREAM || job.output == STD_STREAM)) {
+                throw std::runtime_error("Parallel jobs can't share stdin / stdout: use '-j 1' for jobs with '-'");
+            }
+            if(job.output != STD_STREAM && !outputs.insert(fs::weakly_canonical(fs::absolute(job.output))).second) {
+                throw std::runtime_error("Several jobs write to the same output file '" + job.output + "'");
+            }
+        }
+    }
+    // Конвертирует файлы на пуле из jobs_count потоков.
+    Totals runBatch(std::vector<Job> const& jobs, std::size_t jobs_count, std::string const& format)
+    {
+        Totals totals;
+        std::atomic<std::size_t> next(0);
+        std::mutex mutex;
+
+        auto worker = [&]() {
+            for(std::size_t i = next++; i < jobs.size(); i = next++) {
+                try {
+                    Totals job_totals = convert(jobs[i], format, false);
+                    std::lock_guard<std::mutex> lock(mutex);
+                    totals.files += job_totals.files;
+                    totals.nodes += job_totals.nodes;
+                    totals.bytes_in += job_totals.bytes_in;
+                    totals.bytes_out += job_totals.bytes_out;
+                }
+                catch(std::exception const& e) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    ++totals.failed;
+                    std::cerr << "Error: " << jobs[i].input << ": " << e.what() << "\n";
+                }
+            }
+        };
+
+        std::vector<std::thread> pool;
+        for(std::size_t i = 1; i < std::min(jobs_count, jobs.size()); ++i) {
+            pool.emplace_back(worker);
+        }
+        worker();
+        for(std::thread& thread: pool) {
+            thread.join();
+        }
+
+        return totals;
+    }
+    // Печатает итоги и пропускную способность.
+    void printTotals(Totals const& totals, double seconds)
+    {
+        double mb = static_cast<double>(totals.bytes_in + totals.bytes_out) / 1e6;
+        std::fprintf(stderr, "%zu file(s) converted, %zu failed, %zu nodes, %.1f MB in, %.1f MB out in %.3f s\n",
+                     totals.files, totals.failed, totals.nodes, static_cast<double>(totals.bytes_in) / 1e6,
+                     static_cast<double>(totals.bytes_out) / 1e6, seconds);
+        std::fprintf(stderr, "Throughput: %.0f nodes/s, %.1f MB/s\n",
+                     static_cast<double>(totals.nodes) / seconds, mb / seconds);
+    }
+
+} // namespace
 
 int main(int argc, char* argv[])
 {
@@ -12,14 +253,32 @@ int main(int argc, char* argv[])
 
     opt::options_description desc("All options");
     desc.add_options()
-        ("input,i", opt::value<std::string>(), "input file for loading the tree")
-        ("output,o", opt::value<std::string>(), "output file for saving the tree")
+        ("input,i", opt::value<std::string>(), "input file for loading the tree ('-' for stdin)")
+        ("output,o", opt::value<std::string>(), "output file for saving the tree ('-' for stdout)")
+        ("manifest,m", opt::value<std::string>(), "batch mode: file with 'input output' lines ('-' for stdin)")
+        ("output-dir,d", opt::value<std::string>(), "batch mode: output directory for positional input files")
+        ("jobs,j", opt::value<std::size_t>()->default_value(std::max(1u, std::thread::hardware_concurrency())),
+            "batch mode: number of parallel conversions")
+        ("format,f", opt::value<std::string>()->default_value("sds"),
+            "output format: 'sds', 'sds+idx' (with sidecar snapshot index) or 'img' (read-only image for mmap)")
+        ("no-print,q", "don't clear the screen and print the tree")
         ("help,h", "Produce help message")
         ;
 
+    opt::options_description hidden("Hidden options");
+    hidden.add_options()
+        ("inputs", opt::value<std::vector<std::string>>(), "batch mode: input files (e.g. a shell glob)")
+        ;
+
+    opt::options_description all;
+    all.add(desc).add(hidden);
+
+    opt::positional_options_description positional;
+    positional.add("inputs", -1);
+
     opt::variables_map vm;
 
-    opt::store(opt::parse_command_line(argc, argv, desc), vm);
+    opt::store(opt::command_line_parser(argc, argv).options(all).positional(positional).run(), vm);
 
     opt::notify(vm);
 
@@ -28,36 +287,91 @@ int main(int argc, char* argv[])
         return 1;
     }
 
-    if(!vm.count("help") && !vm.count("input") && !vm.count("output")) {
+    bool batch = vm.count("manifest") || vm.count("inputs");
+
+    if(!batch && !vm.count("input") && !vm.count("output")) {
         std::cout << desc << "\n";
         return 1;
     }
 
-    if(!vm.count("input") && vm.count("output")) {
+    if(!batch && !vm.count("input") && vm.count("output")) {
         std::cout << "Missing required parameter input\n";
         return 1;
     }
 
-    if(vm.count("input") && !vm.count("output")) {
+    if(!batch && vm.count("input") && !vm.count("output")) {
         std::cout << "Missing required parameter output\n";
         return 1;
     }
 
-    // Загрузка дерева, его печать и сохранение
+    if(vm.count("inputs") && !vm.count("output-dir")) {
+        std::cout << "Missing required parameter output-dir\n";
+        return 1;
+    }
 
-    sds::NaryTree tree = sds::NaryTree();
+    std::string format = vm["format"].as<std::string>();
+    if(format != "sds" && format != "sds+idx" && format != "img") {
+        std::cout << "Unknown output format '" << format << "'\n";
+        return 1;
+    }
 
-    sds::loadTreeFromFile(tree, vm["input"].as<std::string>());
-    
-    if(__linux__ && system("clear")) 
-    {
-        std::cerr << "Error: unable to clear the screen\n";
-        return 1;        
-    };
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    // Одиночный режим: загрузка дерева, его печать и сохранение
+
+    if(!batch) {
+        Job job{vm["input"].as<std::string>(), vm["output"].as<std::string>()};
+        bool print = !vm.count("no-print") && job.output != STD_STREAM;
+
+        try {
+            Totals totals = convert(job, format, print);
+            if(!print) {
+                printTotals(totals, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+            }
+        }
+        catch(std::exception const& e) {
+            std::cerr << "Error: " << e.what() << "\n";
+            return 1;
+        }
+
+        return 0;
+    }
+
+    // Пакетный режим: манифест и / или список файлов, конвертация на пуле потоков
+
+    std::vector<Job> jobs;
+    std::size_t jobs_count = std::max<std::size_t>(1, vm["jobs"].as<std::size_t>());
+
+    try {
+        if(vm.count("manifest")) {
+            std::string manifest = vm["manifest"].as<std::string>();
+            if(manifest == STD_STREAM) {
+                jobs = readManifest(std::cin);
+            }
+            else {
+                std::ifstream manifest_file(manifest);
+                if(!manifest_file) {
+                    throw std::runtime_error("Can't open file '" + manifest + "' for reading");
+                }
+                jobs = readManifest(manifest_file);
+            }
+        }
+        if(vm.count("inputs")) {
+            fs::path output_dir(vm["output-dir"].as<std::string>());
+            for(std::string const& input: vm["inputs"].as<std::vector<std::string>>()) {
+                jobs.push_back(Job{input, (output_dir / fs::path(input).filename()).string()});
+            }
+        }
+        checkJobs(jobs, jobs_count, vm.count("manifest") && vm["manifest"].as<std::string>() == STD_STREAM);
+    }
+    catch(std::exception const& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
 
-    tree.print();
+    Totals totals = runBatch(jobs, jobs_count, format);
 
-    sds::saveTreeToFile(tree, vm["output"].as<std::string>());
+    printTotals(totals, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
 
-    return 0;
-}
\ No newline at end of file
+    return totals.failed ? 1 : 0;
+}
@@ -0,0 +1,393 @@
+// Асинхронный ввод-вывод с многобуферной конвейеризацией
+// Автор Д. Шелемех, 2021
+
+#ifndef SDS_ASYNC_IO_HPP
+#define SDS_ASYNC_IO_HPP
+
+#include "constants.hpp"
+#include <streambuf>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <stdexcept>
+
+namespace sds {
+
+    // Набор буферов, которыми обмениваются поток разбора / форматирования и фоновый поток
+    // ввода-вывода: свободные буферы идут в одну сторону, заполненные - в другую.
+    class BufferPipeline
+    {
+    public:
+        // Признак закрытого конвейера
+        static constexpr std::size_t NONE = static_cast<std::size_t>(-1);
+
+    private:
+        std::vector<std::vector<char>> buffers;
+        std::vector<std::size_t> sizes;         // количество данных в буферах
+        std::deque<std::size_t> free_queue;     // индексы свободных буферов
+        std::deque<std::size_t> full_queue;     // индексы заполненных буферов
+        std::mutex mutex;
+        std::condition_variable changed;
+        bool closed;
+        std::exception_ptr error;               // исключение фонового потока
+
+    public:
+        // Структоры
+        BufferPipeline(std::size_t buffer_size, std::size_t buffer_count):
+            buffers(buffer_count, std::vector<char>(buffer_size)), sizes(buffer_count, 0),
+            free_queue(), full_queue(), mutex(), changed(), closed(false), error()
+        {
+            for(std::size_t i = 0; i != buffer_count; ++i) {
+                free_queue.push_back(i);
+            }
+        }
+        BufferPipeline(BufferPipeline const& ) = delete;
+        BufferPipeline& operator=(BufferPipeline const& ) = delete;
+
+        // Аксессоры
+        char* data(std::size_t buffer) noexcept {
+            return buffers[buffer].data();
+        }
+        std::size_t capacity(std::size_t buffer) const noexcept {
+            return buffers[buffer].size();
+        }
+        std::size_t size(std::size_t buffer) const noexcept {
+            return sizes[buffer];
+        }
+
+        // Обмен буферами
+
+        // Возвращает свободный буфер (ждет его появления) или NONE, если конвейер закрыт.
+        std::size_t acquireFree()
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [this] { return closed || !free_queue.empty(); });
+            if(closed) {
+                return NONE;
+            }
+            std::size_t buffer = free_queue.front(); free_queue.pop_front();
+            return buffer;
+        }
+        // Возвращает буфер в число свободных.
+        void releaseFree(std::size_t buffer)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                free_queue.push_back(buffer);
+            }
+            changed.notify_all();
+        }
+        // Передает заполненный буфер другой стороне.
+        void pushFull(std::size_t buffer, std::size_t size)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                sizes[buffer] = size;
+                full_queue.push_back(buffer);
+            }
+            changed.notify_all();
+        }
+        // Возвращает заполненный буфер (ждет его появления) или NONE, если конвейер закрыт и пуст.
+        std::size_t popFull()
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [this] { return closed || !full_queue.empty(); });
+            if(full_queue.empty()) {
+                return NONE;
+            }
+            std::size_t buffer = full_queue.front(); full_queue.pop_front();
+            return buffer;
+        }
+        // Ждет, пока все заполненные буферы не будут обработаны (или конвейер не закроется).
+        void drain()
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [this] {
+                return closed || (full_queue.empty() && free_queue.size() == buffers.size());
+            });
+        }
+        // Закрывает конвейер, будя всех ожидающих.
+        void close(std::exception_ptr reason = nullptr)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                closed = true;
+                if(reason && !error) {
+                    error = reason;
+                }
+            }
+            changed.notify_all();
+        }
+        // Пробрасывает исключение фонового потока, если оно было.
+        void rethrowIfFailed()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if(error) {
+                std::rethrow_exception(error);
+            }
+        }
+    };
+
+    // Буфер потока ввода, который читает файл фоновым потоком вперед на несколько буферов,
+    // так что чтение с диска идет параллельно с разбором уже прочитанных данных.
+    // Выигрыш есть, только если диск медленнее разбора (сравнение - в nary_tree_bench),
+    // поэтому loadTreeFromFile по умолчанию читает блокирующим std::ifstream.
+    class AsyncReadBuf: public std::streambuf
+    {
+    private:
+        std::ifstream file;
+        bool opened;                            // файл открыт (не трогает file из фонового потока)
+        BufferPipeline pipeline;
+        std::size_t current;                    // буфер, отданный на разбор
+        bool finished;                          // достигнут конец файла
+        std::thread reader;
+
+        // Тело фонового потока: заполняет свободные буферы, пустой буфер означает конец файла.
+        void readLoop()
+        {
+            try {
+                for(;;) {
+                    std::size_t buffer = pipeline.acquireFree();
+                    if(buffer == BufferPipeline::NONE) {
+                        return;
+                    }
+
+                    file.read(pipeline.data(buffer), static_cast<std::streamsize>(pipeline.capacity(buffer)));
+                    std::size_t count = static_cast<std::size_t>(file.gcount());
+
+                    if(file.bad()) {
+                        throw std::runtime_error("Error while reading file");
+                    }
+
+                    pipeline.pushFull(buffer, count);
+                    if(count == 0) {
+                        return;
+                    }
+                }
+            }
+            catch(...) {
+                pipeline.close(std::current_exception());
+            }
+        }
+
+    protected:
+        int_type underflow() override
+        {
+            if(gptr() < egptr()) {
+                return traits_type::to_int_type(*gptr());
+            }
+
+            if(current != BufferPipeline::NONE) {
+                pipeline.releaseFree(current);
+                current = BufferPipeline::NONE;
+            }
+
+            if(finished) {
+                return traits_type::eof();
+            }
+
+            std::size_t buffer = pipeline.popFull();
+            if(buffer == BufferPipeline::NONE || pipeline.size(buffer) == 0) {
+                if(buffer != BufferPipeline::NONE) {
+                    pipeline.releaseFree(buffer);
+                }
+                finished = true;
+                return traits_type::eof();
+            }
+
+            current = buffer;
+            char* begin = pipeline.data(buffer);
+            setg(begin, begin, begin + pipeline.size(buffer));
+            return traits_type::to_int_type(*gptr());
+        }
+
+    public:
+        // Структоры
+        AsyncReadBuf(std::string const& file_name, std::size_t buffer_size = ASYNC_BUFFER_SIZE,
+                     std::size_t buffer_count = ASYNC_BUFFER_COUNT):
+            file(file_name, std::ios::binary), opened(file.is_open()), pipeline(buffer_size, buffer_count),
+            current(BufferPipeline::NONE), finished(false), reader()
+        {
+            if(opened) {
+                reader = std::thread(&AsyncReadBuf::readLoop, this);
+            }
+            else {  // без фонового потока конвейер сразу закрыт: чтение дает EOF, close() - ошибку
+                pipeline.close(std::make_exception_ptr(
+                    std::runtime_error("Can't open file '" + file_name + "' for reading")));
+            }
+        }
+        AsyncReadBuf(AsyncReadBuf const& ) = delete;
+        AsyncReadBuf& operator=(AsyncReadBuf const& ) = delete;
+        ~AsyncReadBuf() override
+        {
+            pipeline.close();
+            if(reader.joinable()) {
+                reader.join();
+            }
+        }
+
+        // Запросы
+        bool isOpen() const noexcept {
+            return opened;
+        }
+
+        // Останавливает чтение и пробрасывает ошибку фонового потока, если она была.
+        void close()
+        {
+            pipeline.close();
+            if(reader.joinable()) {
+                reader.join();
+            }
+            pipeline.rethrowIfFailed();
+        }
+    };
+
+    // Буфер потока вывода, который отдает заполненные буферы фоновому потоку записи,
+    // так что форматирование следующих данных идет параллельно с записью предыдущих.
+    class AsyncWriteBuf: public std::streambuf
+    {
+    private:
+        std::ofstream file;
+        bool opened;                            // файл открыт (не трогает file из фонового потока)
+        BufferPipeline pipeline;
+        std::size_t current;                    // буфер, заполняемый форматированием
+        std::size_t submitted;                  // байт, отданных на запись
+        std::thread writer;
+
+        // Тело фонового потока: пишет заполненные буферы и возвращает их свободными.
+        void writeLoop()
+        {
+            try {
+                for(;;) {
+                    std::size_t buffer = pipeline.popFull();
+                    if(buffer == BufferPipeline::NONE) {
+                        return;
+                    }
+
+                    file.write(pipeline.data(buffer), static_cast<std::streamsize>(pipeline.size(buffer)));
+                    if(!file) {
+                        throw std::runtime_error("Error while writing file");
+                    }
+
+                    pipeline.releaseFree(buffer);
+                }
+            }
+            catch(...) {
+                pipeline.close(std::current_exception());
+            }
+        }
+        // Отдает текущий буфер на запись и берет следующий свободный.
+        bool submit()
+        {
+            if(current != BufferPipeline::NONE) {
+                std::size_t count = static_cast<std::size_t>(pptr() - pbase());
+                if(count == 0) {
+                    return true;
+                }
+                pipeline.pushFull(current, count);
+                submitted += count;
+                current = BufferPipeline::NONE;
+                setp(nullptr, nullptr);
+            }
+
+            current = pipeline.acquireFree();
+            if(current == BufferPipeline::NONE) {
+                return false;
+            }
+
+            char* begin = pipeline.data(current);
+            setp(begin, begin + pipeline.capacity(current));
+            return true;
+        }
+
+    protected:
+        int_type overflow(int_type ch) override
+        {
+            if(!submit()) {
+                return traits_type::eof();
+            }
+            if(!traits_type::eq_int_type(ch, traits_type::eof())) {
+                *pptr() = traits_type::to_char_type(ch);
+                pbump(1);
+            }
+            return traits_type::not_eof(ch);
+        }
+        int sync() override
+        {
+            if(current != BufferPipeline::NONE && pptr() != pbase()) {
+                std::size_t count = static_cast<std::size_t>(pptr() - pbase());
+                pipeline.pushFull(current, count);
+                submitted += count;
+                current = BufferPipeline::NONE;
+                setp(nullptr, nullptr);
+            }
+            if(current != BufferPipeline::NONE) {
+                pipeline.releaseFree(current);
+                current = BufferPipeline::NONE;
+                setp(nullptr, nullptr);
+            }
+            pipeline.drain();
+            return file.flush() ? 0 : -1;
+        }
+        // Поддерживает только запрос текущей позиции (tellp), нужный для индексации снимка.
+        pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override
+        {
+            if(off != 0 || dir != std::ios_base::cur || !(which & std::ios_base::out)) {
+                return pos_type(off_type(-1));
+            }
+            return pos_type(static_cast<off_type>(submitted + static_cast<std::size_t>(pptr() - pbase())));
+        }
+
+    public:
+        // Структоры
+        AsyncWriteBuf(std::string const& file_name, std::size_t buffer_size = ASYNC_BUFFER_SIZE,
+                      std::size_t buffer_count = ASYNC_BUFFER_COUNT):
+            file(file_name, std::ios::binary | std::ios::trunc), opened(file.is_open()), pipeline(buffer_size, buffer_count),
+            current(BufferPipeline::NONE), submitted(0), writer()
+        {
+            if(opened) {
+                writer = std::thread(&AsyncWriteBuf::writeLoop, this);
+            }
+            else {  // без фонового потока конвейер сразу закрыт: запись ставит badbit, close() - ошибку
+                pipeline.close(std::make_exception_ptr(
+                    std::runtime_error("Can't open file '" + file_name + "' for writing")));
+            }
+        }
+        AsyncWriteBuf(AsyncWriteBuf const& ) = delete;
+        AsyncWriteBuf& operator=(AsyncWriteBuf const& ) = delete;
+        ~AsyncWriteBuf() override
+        {
+            try {
+                close();
+            }
+            catch(...) {
+                // ошибки записи в деструкторе не пробрасываются; вызывайте close() явно
+            }
+        }
+
+        // Запросы
+        bool isOpen() const noexcept {
+            return opened;
+        }
+
+        // Дописывает все буферы, закрывает файл и пробрасывает ошибку записи, если она была.
+        void close()
+        {
+            if(writer.joinable()) {
+                sync();
+                pipeline.close();
+                writer.join();
+                file.close();
+            }
+            pipeline.rethrowIfFailed();
+        }
+    };
+
+} // namespace sds
+
+#endif
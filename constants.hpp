@@ -4,6 +4,8 @@
 #ifndef SDS_CONSTANTS_HPP
 #define SDS_CONSTANTS_HPP
 
+#include <cstddef>
+
 namespace sds {
 
     // Разделитель между разными данными на одной строке
@@ -14,12 +16,34 @@ namespace sds {
     const char* MAGIC_TAG   = "sds";
     // Версия сериализатора
     const int VERSION       = 1;
+    // Тэг формата индекса снимка
+    const char* INDEX_MAGIC_TAG = "sdx";
+    // Версия формата индекса снимка
+    const int INDEX_VERSION = 2;
+    // Расширение sidecar-файла индекса снимка
+    const char* INDEX_EXT   = ".idx";
+    // Тэг формата манифеста шардов
+    const char* SHARDS_MAGIC_TAG = "sdm";
+    // Версия формата манифеста шардов
+    const int SHARDS_VERSION = 2;
+    // Значение корня-заглушки шарда из нескольких поддеревьев
+    const int SHARD_RUN_ROOT = 0;
+    // Расширение файла манифеста шардов
+    const char* SHARDS_EXT  = ".shards";
+    // Тэг формата образа дерева (не длиннее 7 символов)
+    const char* IMAGE_MAGIC_TAG = "sdi";
+    // Версия формата образа дерева
+    const int IMAGE_VERSION = 1;
     // Идентификатор корня
     const char* ROOT_STR    = "root";
     // Ширина консоли (в символах)
     const int CON_WIDTH     = 136;
     // Ширина узла для печати (в символах)
     const int NODE_WIDTH    = 14;
+    // Размер одного буфера асинхронного ввода-вывода (в байтах)
+    const std::size_t ASYNC_BUFFER_SIZE  = 1 << 20;
+    // Количество буферов асинхронного ввода-вывода
+    const std::size_t ASYNC_BUFFER_COUNT = 4;
 
 } // namespace sds
 
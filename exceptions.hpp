@@ -23,6 +23,13 @@ namespace sds {
         DeserialisationException(std::string const& msg): std::runtime_error(msg) {};
     };
 
+    // Ошибочная структура дерева (нет родителя, циклы, несколько корней)
+    class BadTreeStructure: public std::runtime_error
+    {
+    public:
+        BadTreeStructure(std::string const& msg): std::runtime_error(msg) {};
+    };
+
 
 } // namespace sds
 
@@ -5,40 +5,111 @@
 #define SDS_NARY_TREE_HPP
 
 #include "node.hpp"
+#include "snapshot_index.hpp"
+#include "tree_builder.hpp"
+#include "ancestry_index.hpp"
+#include "subtree_aggregates.hpp"
+#include "node_arena.hpp"
 #include <deque>
 #include <iostream>
+#include <sstream>
+#include <limits>
+#include <unordered_set>
+#include <unordered_map>
+#include <algorithm>
 #include <cassert>
 
 namespace sds {
 
+    // Порядок размещения узлов в памяти (см. NaryTree::relayout)
+    enum class Layout {
+        BreadthFirst,       // обход в ширину: getNodesVector, saveTree, print
+        DepthFirst,         // прямой обход в глубину: обходы поддеревьев
+        VanEmdeBoas         // кэш-независимый: верхняя половина уровней, затем поддеревья нижней половины
+    };
+
+    // Разбивка памяти, занятой деревом (в байтах)
+    struct MemoryUsage {
+        std::size_t nodes;          // число узлов
+        std::size_t node_headers;   // сами узлы вместе с блоками управления std::shared_ptr
+        std::size_t child_arrays;   // буферы kids (по емкости)
+        std::size_t payloads;       // данные узлов, не поместившиеся внутрь std::any
+        std::size_t indexes;        // индекс предков и агрегаты поддеревьев
+
+        std::size_t total() const noexcept {
+            return node_headers + child_arrays + payloads + indexes;
+        }
+    };
+
+    struct Shard;
+
     // Класс дерева
     class NaryTree
     {
     private:
         Node::PointerType root;
+        std::optional<AncestryIndex> ancestry;      // индекс предков (по запросу)
+        std::optional<SubtreeAggregates> aggregates;    // агрегаты поддеревьев (по запросу)
+        std::weak_ptr<NodeArena> arena;             // арена последнего relayout (живет, пока живы ее узлы)
+        std::size_t next_id;                        // id для следующего добавленного узла (свой у каждого дерева)
 
     public:
         // Структоры
-        NaryTree(): root(std::make_shared<Node>(true)) {}
+        NaryTree(): root(std::make_shared<Node>()), ancestry(), aggregates(), arena(), next_id(1) {}
         NaryTree(std::any const& data, std::optional<std::size_t> const& parent, std::size_t level):
-            root(std::make_shared<Node>(data, parent, level, true)) {}
+            root(std::make_shared<Node>(data, parent, level)), ancestry(), aggregates(), arena(), next_id(1) {}
         NaryTree(std::any && data, std::optional<std::size_t> && parent, std::size_t level):
-            root(std::make_shared<Node>(std::move(data), std::move(parent), level, true)) {}
-        NaryTree(Node::PointerType node_ptr): root(node_ptr)
+            root(std::make_shared<Node>(std::move(data), std::move(parent), level)), ancestry(), aggregates(),
+            arena(), next_id(1) {}
+        explicit NaryTree(TreeBuilder && builder): root(), ancestry(), aggregates(), arena(), next_id(builder.size())
+        {
+            root = builder.build();
+        }
+        // Дерево из готовых узлов: корень получает id 0, новые id продолжают наибольший имеющийся.
+        NaryTree(Node::PointerType node_ptr): root(node_ptr), ancestry(), aggregates(), arena(), next_id(1)
         {
             root->id = 0;
-            Node::resetNodeCounter(1);
+            for(Node::PointerType const& node: getNodesVector()) {
+                next_id = std::max<std::size_t>(next_id, node->getId() + 1);
+            }
         }
 
+        // Копия глубокая: у копии свои узлы (с теми же id), свой счетчик id и свои индексы
+        // (пользовательские агрегаты переносятся).
+        NaryTree(NaryTree const& other):
+            root(copyNodes(other.root)), ancestry(), aggregates(other.aggregates), arena(), next_id(other.next_id)
+        {
+            if(other.ancestry) {
+                ancestry.emplace(root);
+            }
+            if(aggregates) {
+                aggregates->rebuild(root);
+            }
+        }
+        NaryTree(NaryTree && ) = default;
         ~NaryTree() = default;
 
+        // Присваивание
+        NaryTree& operator=(NaryTree const& other)
+        {
+            if(this != &other) {
+                *this = NaryTree(other);
+            }
+            return *this;
+        }
+        NaryTree& operator=(NaryTree && ) = default;
+
         // Аксессоры
         Node::PointerType getRoot() const noexcept {
             return root;
         }
-        // Возвращает узел дерева по его id.
+        // Возвращает узел дерева по его id (за O(1), если построен индекс предков).
         Node::PointerType findNodeById(std::size_t id) {
 
+            if(ancestry) {
+                return ancestry->find(id);
+            }
+
             // Breadth-first search
 
             std::deque<Node::PointerType> deque;
@@ -60,29 +131,71 @@ namespace sds {
             return nullptr;
         }
 
+        // Возвращает разбивку памяти, занятой деревом. Блок управления std::make_shared
+        // оценивается как указатель на vtable и два счетчика ссылок; для узлов в арене relayout
+        // берется фактический размер выделения (блок управления там хранит еще и аллокатор).
+        MemoryUsage memoryUsage()
+        {
+            const std::size_t control_block = sizeof(void*) + 2 * sizeof(int);
+            MemoryUsage usage{0, 0, 0, 0, 0};
+            std::shared_ptr<NodeArena> nodes_arena = arena.lock();
+
+            for(Node::PointerType const& node: getNodesVector()) {
+                ++usage.nodes;
+                if(nodes_arena && nodes_arena->contains(node.get())) {
+                    usage.node_headers += nodes_arena->averageAllocation();
+                }
+                else {
+                    usage.node_headers += sizeof(Node) + control_block;
+                }
+                usage.child_arrays += node->kids.capacity() * sizeof(Node::PointerType);
+                usage.payloads += node->payloadBytes();
+            }
+            if(ancestry) {
+                usage.indexes += ancestry->memoryUsage();
+            }
+            if(aggregates) {
+                usage.indexes += aggregates->memoryUsage();
+            }
+
+            return usage;
+        }
+
         // Модификаторы
 
-        // Добавляет потомка для узла дерева.
+        // Добавляет потомка для узла дерева. Если включены индексы, узел, не принадлежащий
+        // дереву (например, полученный до relayout или загрузки), отклоняется.
         // Аргументы:
         // parent - узел
         // data - данные для добавляемого узла
         // Возвращает:
         // Node::PointerType - указатель на добавленный узел.
         Node::PointerType addChild(Node::PointerType& parent, std::any const& data) {
-            parent->kids.push_back(sds::makePointer(data, std::make_optional<std::size_t>(parent->id), 
-                                    parent->level + 1));
-            return parent->kids.back();
+            checkLive(parent);
+            Node::PointerType kid = sds::makePointer(data, std::make_optional<std::size_t>(parent->id), 
+                                                        parent->getLevel() + 1);
+            kid->id = Node::toId(next_id);
+            parent->kids.push_back(kid);
+            ++next_id;
+            onNodeAdded(kid);
+            return kid;
         }
-        // Добавляет потомка для узла дерева.
+        // Добавляет потомка для узла дерева. Если включены индексы, узел, не принадлежащий
+        // дереву (например, полученный до relayout или загрузки), отклоняется.
         // Аргументы:
         // parent - узел
         // data - данные для добавляемого узла
         // Возвращает:
         // Node::PointerType - указатель на добавленный узел.
         Node::PointerType addChild(Node::PointerType& parent, std::any && data) {
-            parent->kids.push_back(sds::makePointer(std::move(data), std::make_optional<std::size_t>(parent->id), 
-                                    parent->level + 1));
-            return parent->kids.back();
+            checkLive(parent);
+            Node::PointerType kid = sds::makePointer(std::move(data), std::make_optional<std::size_t>(parent->id), 
+                                                        parent->getLevel() + 1);
+            kid->id = Node::toId(next_id);
+            parent->kids.push_back(kid);
+            ++next_id;
+            onNodeAdded(kid);
+            return kid;
         }
         // Вставляет узел в дерево. Используется при загрузке дерева из файла.
         // Аргументы:
@@ -92,7 +205,7 @@ namespace sds {
             if(!node.second) {                                                  // root
                 root->data = node.first;
                 root->type = getNodeTypeFromAny(root->data);
-                root->parent = node.second;
+                root->parent = Node::toParent(node.second);
             }
             else {                                                              // not root
                 Node::PointerType node_to_add_to = findNodeById(*node.second);  // find parent
@@ -202,15 +315,18 @@ namespace sds {
         // os - поток для вывода
         void saveTree(std::ostream& os)
         {
-            std::vector<Node::PointerType> save_data(std::move(getNodesVector()));
-
-            outputHeader(os);
-            for(std::size_t i = 0; i != save_data.size(); ++i) {
-                os << *save_data[i];
-                if(i != (save_data.size() - 1)) {
-                    os << EOL;
-                }
-            }
+            writeSnapshot(os, nullptr);
+        }
+        // Сериализует дерево и его индекс (см. SnapshotIndex).
+        // Аргументы:
+        // os - поток для вывода дерева (должен поддерживать tellp)
+        // index_os - поток для вывода индекса
+        void saveTree(std::ostream& os, std::ostream& index_os)
+        {
+            std::vector<SnapshotIndex::Entry> entries;
+            std::streampos start = os.tellp();
+            writeSnapshot(os, &entries);
+            SnapshotIndex(std::move(entries), static_cast<std::size_t>(os.tellp() - start)).save(index_os);
         }
         // Проверяет правильность заголовка формата хранения дерева.
         // Аргументы:
@@ -253,15 +369,730 @@ namespace sds {
             std::istringstream iss(line);
             checkHeader(iss);
 
+            TreeBuilder builder;
+
             while(std::getline(is, line, EOL))
             {
                 std::istringstream iss(line);
-                std::pair<std::any, std::optional<std::size_t>> node = Node::parseNode(iss);
-                insertNode(node);
+                builder.add(Node::parseNode(iss));
+            }
+
+            std::size_t count = builder.size();
+            root = builder.build();
+            next_id = count;
+            onTreeRebuilt();
+        }
+        // Загружает из снимка только поддерево с корнем в записи root_id, не глубже max_depth
+        // уровней от него. Читаются только нужные записи; id узлов совпадают с номерами записей.
+        // Индекс от другого снимка (размер снимка не совпадает или записи не на своих местах)
+        // отклоняется исключением DeserialisationException.
+        // Аргументы:
+        // is - поток со снимком дерева (должен поддерживать seekg)
+        // index - индекс этого снимка
+        // root_id - id (номер записи) корня поддерева
+        // max_depth - максимальная глубина относительно корня поддерева (0 - только корень)
+        void loadSubtree(std::istream& is, SnapshotIndex const& index, std::size_t root_id,
+                         std::size_t max_depth = std::numeric_limits<std::size_t>::max())
+        {
+            if(root_id >= index.size()) {
+                std::string msg = "Couldn't find node with ID = " + std::to_string(root_id);
+                throw std::runtime_error(msg);
+            }
+
+            std::string line;
+
+            is.clear();
+            is.seekg(0, std::ios::end);
+            if(is.tellg() != std::streampos(static_cast<std::streamoff>(index.snapshotSize()))) {
+                throw DeserialisationException("Snapshot doesn't match its index");
+            }
+
+            // запись по смещению из чужого индекса может начинаться с середины строки
+            auto parseRecord = [](std::string const& line) {
+                std::istringstream iss(line);
+                try {
+                    return Node::parseNode(iss);
+                }
+                catch(std::logic_error const& ) {   // std::invalid_argument, std::out_of_range из std::sto*
+                    throw DeserialisationException("Snapshot doesn't match its index");
+                }
+            };
+
+            is.clear();
+            is.seekg(static_cast<std::streamoff>(index[root_id].offset));
+            if(!std::getline(is, line, EOL) || line.empty() || line[0] != '{') {
+                throw DeserialisationException("Snapshot doesn't match its index");
+            }
+
+            std::pair<std::any, std::optional<std::size_t>> root_node = parseRecord(line);
+
+            root = std::make_shared<Node>(std::move(root_node.first), std::nullopt, 0);
+            root->id = Node::toId(root_id);
+
+            // поддерево читается по уровням: каждый уровень - непрерывный диапазон записей
+            std::vector<Node::PointerType> level_nodes(1, root), next_level;
+            std::size_t first = root_id, last = root_id + 1;
+
+            for(std::size_t depth = 1; depth <= max_depth; ++depth) {
+
+                std::pair<std::size_t, std::size_t> kids = index.kidsRange(first, last);
+                if(kids.first == kids.second) {
+                    break;
+                }
+
+                is.clear();
+                is.seekg(static_cast<std::streamoff>(index[kids.first].offset));
+
+                next_level.clear();
+                next_level.reserve(kids.second - kids.first);
+
+                for(std::size_t record = kids.first; record != kids.second; ++record) {
+                    if(!std::getline(is, line, EOL) || line.empty() || line[0] != '{') {
+                        throw DeserialisationException("Snapshot doesn't match its index");
+                    }
+
+                    std::pair<std::any, std::optional<std::size_t>> node = parseRecord(line);
+
+                    if(!node.second || *node.second < first || *node.second >= last) {
+                        throw DeserialisationException("Snapshot doesn't match its index");
+                    }
+
+                    Node::PointerType& parent = level_nodes[*node.second - first];
+                    if(parent->kids.empty()) {
+                        parent->kids.reserve(index[*node.second].kids_count);
+                    }
+
+                    parent->kids.push_back(sds::makePointer(std::move(node.first),
+                                                            std::make_optional<std::size_t>(parent->id),
+                                                            parent->getLevel() + 1));
+                    next_level.push_back(parent->kids.back());
+                    next_level.back()->id = Node::toId(record);
+                }
+
+                level_nodes.swap(next_level);
+                first = kids.first;
+                last = kids.second;
+            }
+
+            // новые узлы не должны пересекаться по id с записями снимка
+            next_id = index.size();
+            onTreeRebuilt();
+        }
+        // Загружает поддерево из снимка, строя индекс просмотром потока.
+        // Аргументы: см. loadSubtree(is, index, root_id, max_depth)
+        void loadSubtree(std::istream& is, std::size_t root_id,
+                         std::size_t max_depth = std::numeric_limits<std::size_t>::max())
+        {
+            is.clear();
+            is.seekg(0);
+            SnapshotIndex index = SnapshotIndex::build(is);
+            loadSubtree(is, index, root_id, max_depth);
+        }
+
+        // Извлечение поддеревьев и шардирование
+
+        // Возвращает копию поддерева узла как самостоятельное дерево: node становится корнем,
+        // id перенумерованы с 0 в порядке обхода в ширину, уровни отсчитываются от нового корня.
+        NaryTree extractSubtree(Node::PointerType const& node) const
+        {
+            return copyPart(std::vector<Node const*>(1, node.get()), std::unordered_set<Node const*>(),
+                            [](Node const*, std::size_t, std::size_t) {});
+        }
+        // Делит дерево на не более чем k шардов, близких по числу узлов (см. Shard).
+        std::vector<Shard> shard(std::size_t k);
+        // Сшивает шарды (в порядке, который возвращает shard) обратно в одно дерево за линейное время.
+        // id узлов перенумеровываются в порядке обхода в ширину.
+        static NaryTree merge(std::vector<Shard> && shards);
+        // Собирает дерево шарда из нескольких корней (см. Shard::count): корни становятся потомками
+        // корня-заглушки SHARD_RUN_ROOT, id перенумеровываются в порядке обхода в ширину.
+        // Аргументы:
+        // roots - деревья корней в порядке следования среди братьев
+        static NaryTree joinRun(std::vector<NaryTree> && roots)
+        {
+            NaryTree run(std::make_any<int>(SHARD_RUN_ROOT), std::nullopt, 0);
+
+            run.root->kids.reserve(roots.size());
+            for(NaryTree& part: roots) {
+                run.root->kids.push_back(part.root);
+            }
+            run.renumber();
+            return run;
+        }
+
+        // Размещение в памяти
+
+        // Переразмещает дерево в непрерывной памяти в порядке layout: узлы вместе с блоками
+        // управления std::shared_ptr выделяются подряд в одной арене, буферы kids - заново,
+        // с точной емкостью и в том же порядке. id, уровни, данные и индексы сохраняются.
+        // Данные копируются, поэтому указатели на узлы, полученные до вызова, остаются читаемыми,
+        // но это уже отсоединенные от дерева листья (isDetached, id - Node::DETACHED_ID):
+        // addChild к ним отклоняется исключением.
+        void relayout(Layout layout)
+        {
+            std::vector<Node::PointerType> old_nodes = layoutOrder(layout);
+            std::size_t count = old_nodes.size();
+            std::vector<Node::PointerType> new_nodes(count);
+            std::shared_ptr<NodeArena> new_arena = std::make_shared<NodeArena>(count * (sizeof(Node) + 4 * sizeof(void*)));
+            ArenaAllocator<Node> allocator(new_arena);
+
+            // на время переноса id старого узла - его номер в новом порядке
+            for(std::size_t i = 0; i != count; ++i) {
+                Node const& old_node = *old_nodes[i];
+                new_nodes[i] = std::allocate_shared<Node>(allocator, old_node.data, old_node.getParent(),
+                                                          old_node.getLevel());
+                new_nodes[i]->id = old_node.id;
+                old_nodes[i]->id = Node::toId(i);
+            }
+            for(std::size_t i = 0; i != count; ++i) {
+                Node::KidsContainerType& kids = new_nodes[i]->kids;
+                kids.reserve(old_nodes[i]->kids.size());
+                for(Node::PointerType const& kid: old_nodes[i]->kids) {
+                    kids.push_back(new_nodes[kid->id]);
+                }
+            }
+            // старые узлы помечаются отсоединенными и отпускают потомков, чтобы устаревший указатель
+            // не держал старую копию дерева
+            for(std::size_t i = 0; i != count; ++i) {
+                old_nodes[i]->id = Node::DETACHED_ID;
+                old_nodes[i]->kids.clear();
+                old_nodes[i]->kids.shrink_to_fit();
+            }
+
+            root = new_nodes[0];
+            arena = new_arena;
+            onTreeRebuilt();
+        }
+        // Переразмещает дерево в порядке обхода в ширину (см. relayout).
+        void compact()
+        {
+            relayout(Layout::BreadthFirst);
+        }
+
+        // Запросы предков
+
+        // Строит индекс предков (см. AncestryIndex). Далее он поддерживается при addChild,
+        // а findNodeById, isAncestor, lca и pathToRoot работают через него.
+        void enableAncestryIndex()
+        {
+            ancestry.emplace(root);
+        }
+        // Удаляет индекс предков.
+        void disableAncestryIndex() noexcept
+        {
+            ancestry.reset();
+        }
+        bool hasAncestryIndex() const noexcept {
+            return ancestry.has_value();
+        }
+        // Восстанавливает O(1)-проверку isAncestor после серии addChild (перенумерация за O(n)).
+        void renumberAncestryIndex()
+        {
+            if(ancestry) {
+                ancestry->renumber();
+            }
+        }
+        // Является ли узел ancestor_id предком узла node_id (узел считается предком самого себя).
+        // Без индекса - поиском пути за O(n).
+        bool isAncestor(std::size_t ancestor_id, std::size_t node_id)
+        {
+            if(ancestry) {
+                return ancestry->isAncestor(ancestor_id, node_id);
+            }
+
+            std::vector<Node::PointerType> path = findPathFromRoot(node_id);
+            for(Node::PointerType const& node: path) {
+                if(node->id == ancestor_id) {
+                    return true;
+                }
+            }
+
+            findPathFromRoot(ancestor_id);  // бросает исключение, если узла нет
+            return false;
+        }
+        // Возвращает наименьшего общего предка двух узлов.
+        // Без индекса - поиском путей за O(n).
+        Node::PointerType lca(std::size_t first_id, std::size_t second_id)
+        {
+            if(ancestry) {
+                return ancestry->find(ancestry->lca(first_id, second_id));
+            }
+
+            std::vector<Node::PointerType> first = findPathFromRoot(first_id);
+            std::vector<Node::PointerType> second = findPathFromRoot(second_id);
+            std::size_t i = 0;
+            while(i + 1 < first.size() && i + 1 < second.size() && first[i + 1] == second[i + 1]) {
+                ++i;
             }
+            return first[i];
+        }
+        // Возвращает путь от узла до корня (включительно).
+        // Без индекса - поиском пути за O(n).
+        std::vector<Node::PointerType> pathToRoot(std::size_t id)
+        {
+            if(ancestry) {
+                return ancestry->pathToRoot(id);
+            }
+
+            std::vector<Node::PointerType> path = findPathFromRoot(id);
+            return std::vector<Node::PointerType>(path.rbegin(), path.rend());
         }
+
+        // Агрегаты поддеревьев
+
+        // Включает агрегаты поддеревьев (см. SubtreeAggregates). Далее они поддерживаются при addChild
+        // за O(h), а запросы subtreeSize, subtreeHeight, subtreeSum / IntegerSum / Min / Max и aggregate - за O(1).
+        void enableAggregates()
+        {
+            if(!aggregates) {
+                aggregates.emplace(root);
+            }
+        }
+        // Удаляет агрегаты поддеревьев (вместе с зарегистрированными пользовательскими).
+        void disableAggregates() noexcept
+        {
+            aggregates.reset();
+        }
+        bool hasAggregates() const noexcept {
+            return aggregates.has_value();
+        }
+        // Регистрирует пользовательский агрегат (включает агрегаты, если нужно).
+        // Возвращает:
+        // std::size_t - номер агрегата для aggregate(id, k)
+        std::size_t registerAggregate(Aggregator const& aggregator)
+        {
+            enableAggregates();
+            return aggregates->add(aggregator);
+        }
+        // Возвращает значение агрегата k для поддерева узла id.
+        // Без включенных агрегатов встроенные считаются обходом поддерева.
+        double aggregate(std::size_t id, std::size_t k)
+        {
+            if(aggregates) {
+                return aggregates->get(id, k);
+            }
+
+            Node::PointerType node = findNodeById(id);
+            if(!node) {
+                std::string msg = "Couldn't find node with ID = " + std::to_string(id);
+                throw std::runtime_error(msg);
+            }
+            return SubtreeAggregates::walk(*node, SubtreeAggregates::builtin(k));
+        }
+        // Число узлов поддерева.
+        std::size_t subtreeSize(std::size_t id) {
+            return static_cast<std::size_t>(aggregate(id, SubtreeAggregates::COUNT));
+        }
+        // Высота поддерева (0 - лист).
+        std::size_t subtreeHeight(std::size_t id) {
+            return static_cast<std::size_t>(aggregate(id, SubtreeAggregates::MAX_LEVEL)) - findNodeById(id)->getLevel();
+        }
+        // Сумма значений Int / Long / Double поддерева. Считается в double, поэтому суммы Long
+        // больше 2^53 по модулю теряют точность - для них есть subtreeIntegerSum.
+        double subtreeSum(std::size_t id) {
+            return aggregate(id, SubtreeAggregates::SUM);
+        }
+        // Точная сумма значений Int / Long поддерева (Double не учитываются).
+        // Без включенных агрегатов считается обходом поддерева.
+        long long subtreeIntegerSum(std::size_t id)
+        {
+            if(aggregates) {
+                return aggregates->integerSum(id);
+            }
+
+            Node::PointerType node = findNodeById(id);
+            if(!node) {
+                std::string msg = "Couldn't find node with ID = " + std::to_string(id);
+                throw std::runtime_error(msg);
+            }
+            return SubtreeAggregates::walkIntegerSum(*node);
+        }
+        // Минимум значений Int / Long / Double поддерева (+inf, если их нет).
+        double subtreeMin(std::size_t id) {
+            return aggregate(id, SubtreeAggregates::MIN);
+        }
+        // Максимум значений Int / Long / Double поддерева (-inf, если их нет).
+        double subtreeMax(std::size_t id) {
+            return aggregate(id, SubtreeAggregates::MAX);
+        }
+
+    private:
+        // Проверяет, что узел принадлежит дереву (по построенным индексам, иначе проверка пропускается),
+        // чтобы добавление к устаревшему узлу не испортило индексы.
+        void checkLive(Node::PointerType const& node) const
+        {
+            if(node->isDetached() || (ancestry && ancestry->find(node->getId()) != node) ||
+               (aggregates && !aggregates->contains(node.get()))) {
+                std::string msg = "Node with ID = " + std::to_string(node->getId()) + " doesn't belong to the tree";
+                throw std::runtime_error(msg);
+            }
+        }
+        // Вызывается после добавления узла: поддерживает построенные индексы.
+        void onNodeAdded(Node::PointerType const& node)
+        {
+            if(ancestry) {
+                ancestry->addLeaf(node);
+            }
+            if(aggregates) {
+                aggregates->addLeaf(node);
+            }
+        }
+        // Вызывается после замены дерева целиком (загрузка): перестраивает построенные индексы.
+        void onTreeRebuilt()
+        {
+            if(ancestry) {
+                ancestry.emplace(root);
+            }
+            if(aggregates) {
+                aggregates->rebuild(root);
+            }
+        }
+        // Перенумеровывает id, id родителей и уровни в порядке обхода в ширину.
+        void renumber()
+        {
+            std::vector<Node*> order(1, root.get());
+
+            root->id = 0;
+            root->parent = Node::NO_PARENT;
+            root->level = 0;
+            for(std::size_t i = 0; i != order.size(); ++i) {
+                for(Node::PointerType const& kid: order[i]->kids) {
+                    kid->id = Node::toId(order.size());
+                    kid->parent = order[i]->id;
+                    kid->level = Node::toLevel(order[i]->getLevel() + 1);
+                    order.push_back(kid.get());
+                }
+            }
+
+            next_id = order.size();
+            onTreeRebuilt();
+        }
+        // Возвращает копию узлов поддерева top (id, уровни и данные сохраняются).
+        static Node::PointerType copyNodes(Node::PointerType const& top)
+        {
+            if(!top) {
+                return top;
+            }
+
+            Node::PointerType copy = std::make_shared<Node>(*top);
+            std::vector<Node*> order(1, copy.get());
+            for(std::size_t i = 0; i != order.size(); ++i) {
+                for(Node::PointerType& kid: order[i]->kids) {
+                    kid = std::make_shared<Node>(*kid);
+                    order.push_back(kid.get());
+                }
+            }
+            return copy;
+        }
+        // Копирует часть дерева от узлов tops, не заходя в узлы из cuts, в новое дерево с id
+        // в порядке обхода в ширину.
+        // Аргументы:
+        // tops - корни копируемой части; если их несколько, они становятся потомками
+        //        корня-заглушки SHARD_RUN_ROOT
+        // cuts - узлы, которые (вместе с поддеревьями) не копируются
+        // on_cut - вызывается для каждого пропущенного узла: (узел, id его родителя в копии,
+        //          позиция среди потомков родителя в исходном дереве)
+        template <typename OnCut>
+        static NaryTree copyPart(std::vector<Node const*> const& tops, std::unordered_set<Node const*> const& cuts,
+                                 OnCut on_cut)
+        {
+            TreeBuilder builder;
+            std::vector<Node const*> order(tops);
+            std::size_t first = tops.size() == 1 ? 0 : 1;     // id первого узла order в копии
+
+            if(first) {
+                builder.add(std::make_any<int>(SHARD_RUN_ROOT), std::nullopt);
+            }
+            for(Node const* top: tops) {
+                builder.add(top->data, first ? std::make_optional<std::size_t>(0) : std::nullopt);
+            }
+            for(std::size_t i = 0; i != order.size(); ++i) {
+                for(std::size_t k = 0; k != order[i]->kids.size(); ++k) {
+                    Node const* kid = order[i]->kids[k].get();
+                    if(cuts.count(kid)) {
+                        on_cut(kid, first + i, k);
+                        continue;
+                    }
+                    builder.add(kid->data, first + i);
+                    order.push_back(kid);
+                }
+            }
+
+            return NaryTree(std::move(builder));
+        }
+        // Возвращает узлы дерева в порядке layout (корень первый).
+        std::vector<Node::PointerType> layoutOrder(Layout layout)
+        {
+            std::vector<Node::PointerType> order;
+
+            if(layout == Layout::BreadthFirst) {
+                order = getNodesVector();
+            }
+            else if(layout == Layout::DepthFirst) {
+                std::vector<Node::PointerType> stack(1, root);
+                while(!stack.empty()) {
+                    Node::PointerType node = std::move(stack.back());
+                    stack.pop_back();
+                    stack.insert(stack.end(), node->kids.rbegin(), node->kids.rend());
+                    order.push_back(std::move(node));
+                }
+            }
+            else {
+                std::size_t height = getNodesVector().back()->getLevel() - root->getLevel() + 1;
+                vanEmdeBoasOrder(root, height, order);
+            }
+
+            return order;
+        }
+        // Добавляет в order верхние height уровней поддерева узла в порядке ван Эмде Боаса:
+        // сначала (рекурсивно) верхняя половина уровней, затем поддеревья нижней половины слева направо.
+        static void vanEmdeBoasOrder(Node::PointerType const& node, std::size_t height,
+                                     std::vector<Node::PointerType>& order)
+        {
+            if(height == 1) {
+                order.push_back(node);
+                return;
+            }
+
+            std::size_t top = height / 2;
+            vanEmdeBoasOrder(node, top, order);
+
+            // корни поддеревьев нижней половины - узлы на глубине top
+            std::vector<Node::PointerType> bottoms(1, node), next;
+            for(std::size_t depth = 0; depth != top; ++depth) {
+                next.clear();
+                for(Node::PointerType const& bottom: bottoms) {
+                    next.insert(next.end(), bottom->kids.begin(), bottom->kids.end());
+                }
+                bottoms.swap(next);
+            }
+
+            for(Node::PointerType const& bottom: bottoms) {
+                vanEmdeBoasOrder(bottom, height - top, order);
+            }
+        }
+        // Возвращает путь от корня до узла обходом в глубину.
+        std::vector<Node::PointerType> findPathFromRoot(std::size_t id)
+        {
+            std::vector<Node::PointerType> path(1, root);
+            std::vector<std::size_t> next_kid(1, 0);
+
+            while(!path.empty()) {
+                if(path.back()->id == id) {
+                    return path;
+                }
+                if(next_kid.back() == path.back()->kids.size()) {
+                    path.pop_back();
+                    next_kid.pop_back();
+                    continue;
+                }
+                path.push_back(path.back()->kids[next_kid.back()++]);
+                next_kid.push_back(0);
+            }
+
+            std::string msg = "Couldn't find node with ID = " + std::to_string(id);
+            throw std::runtime_error(msg);
+        }
+        // Выводит снимок дерева в порядке обхода в ширину. Родитель каждой записи задается
+        // номером его записи, что совпадает с id узлов после загрузки.
+        // Аргументы:
+        // os - поток для вывода
+        // entries - если не nullptr, сюда заносятся элементы индекса снимка
+        void writeSnapshot(std::ostream& os, std::vector<SnapshotIndex::Entry>* entries)
+        {
+            std::vector<Node::PointerType> save_data(getNodesVector());
+            std::vector<std::size_t> parent_record(save_data.size(), 0);
+            std::streampos start = os.tellp();
+            std::size_t next = 1;
+
+            if(entries) {
+                if(start == std::streampos(-1)) {
+                    throw std::runtime_error("Can't index a snapshot written to a non-seekable stream");
+                }
+                entries->reserve(save_data.size());
+            }
+
+            outputHeader(os);
+            for(std::size_t i = 0; i != save_data.size(); ++i) {
+                Node const& node = *save_data[i];
+
+                if(entries) {
+                    entries->push_back(SnapshotIndex::Entry{static_cast<std::size_t>(os.tellp() - start),
+                                                            next, node.kids.size()});
+                }
+                for(std::size_t k = 0; k != node.kids.size(); ++k) {
+                    parent_record[next++] = i;
+                }
+
+                node.writeRecord(os, i ? std::make_optional(parent_record[i]) : std::nullopt);
+                if(i != (save_data.size() - 1)) {
+                    os << EOL;
+                }
+            }
+        }
+    };
+
+    // Шард дерева: поддерево или серия подряд идущих поддеревьев-братьев, вырезанные из исходного
+    // дерева, и точка, куда их вшивать обратно.
+    struct Shard {
+        NaryTree tree;                              // часть дерева с id в порядке обхода в ширину
+        std::size_t root_id;                        // id (первого) корня шарда в исходном дереве
+        std::optional<std::size_t> parent_shard;    // шард, к узлу которого вшивается корень (нет - корневой)
+        std::size_t attach_id;                      // id (в родительском шарде) узла, к которому вшивается корень
+        std::size_t position;                       // позиция (первого) корня среди потомков этого узла
+        std::size_t count;                          // число корней; если больше 1, корень tree - заглушка
+                                                    // SHARD_RUN_ROOT, а корни шарда - ее потомки
     };
 
+    // Делит дерево на не более чем k шардов с наименьшим (для жадного разреза) наибольшим шардом.
+    // Для порога T обход снизу вверх считает размер еще не отрезанной части каждого поддерева;
+    // если у узла он больше T, потомки узла пакуются подряд в серии не больше T узлов и от узла
+    // отрезаются наибольшие серии, пока остаток не станет не больше T. Так каждый шард, включая
+    // корневой, не больше T узлов, а широкие узлы делятся на несколько шардов. Наименьший T,
+    // при котором шардов не больше k, ищется двоичным поиском на [ceil(n / k), n]: O(n log^2 n).
+    // Шард 0 - корневой, остальные идут в порядке обхода в ширину их первых корней, поэтому
+    // родительский шард всегда раньше дочернего, а дочерние шарды одного узла - по возрастанию позиции.
+    inline std::vector<Shard> NaryTree::shard(std::size_t k)
+    {
+        if(!k) {
+            throw std::runtime_error("Number of shards must be positive");
+        }
+
+        // при обходе в ширину потомки узла i занимают позиции [first_kid[i], first_kid[i] + число потомков)
+        std::vector<Node const*> order(1, root.get());
+        std::vector<std::size_t> first_kid;
+        for(std::size_t i = 0; i != order.size(); ++i) {
+            first_kid.push_back(order.size());
+            for(Node::PointerType const& kid: order[i]->kids) {
+                order.push_back(kid.get());
+            }
+        }
+
+        // серия: позиция первого корня при обходе в ширину, число корней и размер
+        struct Run {
+            std::size_t first;
+            std::size_t count;
+            std::size_t size;
+        };
+        std::vector<std::size_t> rest(order.size());
+        std::vector<Run> packed;
+
+        auto cut = [&](std::size_t threshold) {
+            std::vector<Run> runs;
+            for(std::size_t i = order.size(); i-- > 0; ) {
+                rest[i] = 1;
+                packed.clear();
+                for(std::size_t j = first_kid[i]; j != first_kid[i] + order[i]->kids.size(); ++j) {
+                    rest[i] += rest[j];
+                    if(packed.empty() || packed.back().size + rest[j] > threshold) {
+                        packed.push_back(Run{j, 1, rest[j]});
+                    }
+                    else {
+                        ++packed.back().count;
+                        packed.back().size += rest[j];
+                    }
+                }
+                if(rest[i] <= threshold) {
+                    continue;
+                }
+                std::stable_sort(packed.begin(), packed.end(), [](Run const& a, Run const& b) { return a.size > b.size; });
+                for(std::size_t r = 0; r != packed.size() && rest[i] > threshold; ++r) {
+                    rest[i] -= packed[r].size;
+                    runs.push_back(packed[r]);
+                }
+            }
+            return runs;
+        };
+
+        std::size_t low = (order.size() + k - 1) / k, high = order.size();
+        while(low < high) {
+            std::size_t middle = low + (high - low) / 2;
+            if(cut(middle).size() < k) {
+                high = middle;
+            }
+            else {
+                low = middle + 1;
+            }
+        }
+        std::vector<Run> runs = cut(low);
+        std::sort(runs.begin(), runs.end(), [](Run const& a, Run const& b) { return a.first < b.first; });
+
+        // номера шардов: корневой, затем серии в порядке обхода в ширину
+        std::vector<std::vector<Node const*>> tops(1, std::vector<Node const*>(1, root.get()));
+        std::unordered_set<Node const*> cuts;
+        std::unordered_map<Node const*, std::size_t> shard_of;     // первый корень серии -> шард
+        for(Run const& run: runs) {
+            shard_of[order[run.first]] = tops.size();
+            tops.emplace_back(order.begin() + static_cast<std::ptrdiff_t>(run.first),
+                              order.begin() + static_cast<std::ptrdiff_t>(run.first + run.count));
+            cuts.insert(tops.back().begin(), tops.back().end());
+        }
+
+        std::vector<Shard> shards;
+        std::vector<std::optional<std::size_t>> parent_shards(tops.size());
+        std::vector<std::size_t> attach_ids(tops.size(), 0), positions(tops.size(), 0);
+
+        shards.reserve(tops.size());
+        for(std::size_t s = 0; s != tops.size(); ++s) {
+            NaryTree part = copyPart(tops[s], cuts, [&](Node const* cut, std::size_t parent_id, std::size_t position) {
+                auto it = shard_of.find(cut);
+                if(it != shard_of.end()) {
+                    parent_shards[it->second] = s;
+                    attach_ids[it->second] = parent_id;
+                    positions[it->second] = position;
+                }
+            });
+            shards.push_back(Shard{std::move(part), tops[s].front()->getId(), std::nullopt, 0, 0, tops[s].size()});
+        }
+        for(std::size_t s = 0; s != shards.size(); ++s) {
+            shards[s].parent_shard = parent_shards[s];
+            shards[s].attach_id = attach_ids[s];
+            shards[s].position = positions[s];
+        }
+
+        return shards;
+    }
+
+    inline NaryTree NaryTree::merge(std::vector<Shard> && shards)
+    {
+        if(shards.empty() || shards[0].parent_shard || shards[0].count != 1) {
+            throw BadTreeStructure("The first shard must be the root shard");
+        }
+
+        // узлы каждого шарда по id (id шарда идут подряд в порядке обхода в ширину)
+        std::vector<std::vector<Node::PointerType>> nodes(shards.size());
+        for(std::size_t s = 0; s != shards.size(); ++s) {
+            nodes[s] = shards[s].tree.getNodesVector();
+            for(std::size_t i = 0; i != nodes[s].size(); ++i) {
+                if(nodes[s][i]->getId() != i) {
+                    throw BadTreeStructure("Shard " + std::to_string(s) + " isn't numbered in breadth-first order");
+                }
+            }
+        }
+
+        for(std::size_t s = 1; s != shards.size(); ++s) {
+            Shard const& shard = shards[s];
+            if(!shard.parent_shard || *shard.parent_shard >= s || shard.attach_id >= nodes[*shard.parent_shard].size()) {
+                throw BadTreeStructure("Shard " + std::to_string(s) + " has a wrong attachment point");
+            }
+            if(!shard.count || (shard.count > 1 && shard.tree.root->kids.size() != shard.count)) {
+                throw BadTreeStructure("Shard " + std::to_string(s) + " has a wrong number of roots");
+            }
+
+            Node::KidsContainerType& kids = nodes[*shard.parent_shard][shard.attach_id]->kids;
+            auto position = kids.begin() + static_cast<std::ptrdiff_t>(std::min(shard.position, kids.size()));
+            if(shard.count == 1) {
+                kids.insert(position, shard.tree.root);
+            }
+            else {
+                kids.insert(position, shard.tree.root->kids.begin(), shard.tree.root->kids.end());
+            }
+        }
+
+        NaryTree merged(shards[0].tree.root);
+        merged.renumber();
+        return merged;
+    }
+
 } // namespace sds
 
 #endif
\ No newline at end of file
@@ -0,0 +1,234 @@
+#include "nary_tree.hpp"
+#include "utilities.hpp"
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <string>
+#include <cstdio>
+#include <sstream>
+#include <utility>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+
+    using Clock = std::chrono::steady_clock;
+
+    // Возвращает значение i-го узла тестового дерева (типы чередуются).
+    std::any makeValue(std::size_t i)
+    {
+        switch(i % 4) {
+            case 0: return static_cast<int>(i);
+            case 1: return static_cast<double>(i) / 7;
+            case 2: return "node #" + std::to_string(i);
+            default: return static_cast<long>(i) * 1000003L;
+        }
+    }
+    // Строит дерево из n узлов со случайными родителями и разнотипными значениями.
+    sds::NaryTree makeRandomTree(std::size_t n, unsigned seed = 2021)
+    {
+        sds::NaryTree tree(std::make_any<int>(0), std::nullopt, 0);
+        std::vector<sds::Node::PointerType> nodes(1, tree.getRoot());
+        std::mt19937 gen(seed);
+
+        nodes.reserve(n);
+        for(std::size_t i = 1; i < n; ++i) {
+            std::uniform_int_distribution<std::size_t> pick(0, nodes.size() - 1);
+            nodes.push_back(tree.addChild(nodes[pick(gen)], makeValue(i)));
+        }
+
+        return tree;
+    }
+    // Вытесняет файл из page cache, чтобы следующее чтение шло с диска.
+    // Возвращает false, если ОС не поддерживает это.
+    bool dropFileCache(std::string const& file_name)
+    {
+        int fd = ::open(file_name.c_str(), O_RDONLY);
+        if(fd < 0) {
+            return false;
+        }
+        bool ok = ::fdatasync(fd) == 0 && ::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) == 0;
+        ::close(fd);
+        return ok;
+    }
+    // Возвращает время в секундах, прошедшее с start.
+    double secondsSince(Clock::time_point start)
+    {
+        return std::chrono::duration<double>(Clock::now() - start).count();
+    }
+    // Печатает строку результата.
+    void report(std::string const& name, double seconds, std::size_t bytes, std::size_t nodes)
+    {
+        std::printf("%-36s %9.3f s %10.1f MB/s %12.0f nodes/s\n", name.c_str(), seconds,
+                    static_cast<double>(bytes) / 1e6 / seconds, static_cast<double>(nodes) / seconds);
+    }
+    // Печатает строку результата для запросов.
+    void reportQueries(std::string const& name, double seconds, std::size_t queries)
+    {
+        std::printf("%-36s %9.3f s %12.0f queries/s\n", name.c_str(), seconds,
+                    static_cast<double>(queries) / seconds);
+    }
+    // Выполняет запросы isAncestor / lca / pathToRoot к случайным парам узлов.
+    // Возвращает контрольную сумму, чтобы компилятор не выбросил запросы.
+    std::size_t runAncestryQueries(sds::NaryTree& tree, std::size_t n, std::size_t queries)
+    {
+        std::mt19937 gen(7);
+        std::uniform_int_distribution<std::size_t> pick(0, n - 1);
+        std::size_t checksum = 0;
+
+        for(std::size_t i = 0; i != queries; ++i) {
+            std::size_t a = pick(gen), b = pick(gen);
+            checksum += tree.isAncestor(a, b);
+            checksum += tree.lca(a, b)->getId();
+            checksum += tree.pathToRoot(b).size();
+        }
+
+        return checksum;
+    }
+    // Обходит дерево так, как это делают getNodesVector и saveTree, и печатает пропускную способность.
+    // Возвращает контрольную сумму, чтобы компилятор не выбросил обходы.
+    std::size_t runWalks(sds::NaryTree& tree, std::string const& layout, std::size_t n)
+    {
+        const int rounds = 5;
+        std::size_t checksum = 0;
+
+        Clock::time_point start = Clock::now();
+        for(int i = 0; i != rounds; ++i) {
+            for(sds::Node::PointerType const& node: tree.getNodesVector()) {
+                checksum += node->getLevel();
+            }
+        }
+        report("walk, getNodesVector, " + layout, secondsSince(start) / rounds, 0, n);
+
+        start = Clock::now();
+        for(int i = 0; i != rounds; ++i) {
+            std::ostringstream os;
+            tree.saveTree(os);
+            checksum += os.str().size();
+        }
+        report("walk, saveTree, " + layout, secondsSince(start) / rounds, 0, n);
+
+        return checksum;
+    }
+    // Возвращает размер файла в байтах.
+    std::size_t fileSize(std::string const& file_name)
+    {
+        std::ifstream file(file_name, std::ios::binary | std::ios::ate);
+        return static_cast<std::size_t>(file.tellg());
+    }
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    std::size_t n = argc > 1 ? std::stoul(argv[1]) : 1000000;
+    const std::string file_name = "nary_tree_bench.tmp";
+
+    std::printf("Benchmark tree: %zu nodes\n\n", n);
+
+    // Построение: addChild по одному узлу против пакетного TreeBuilder
+
+    Clock::time_point start = Clock::now();
+    sds::NaryTree tree = makeRandomTree(n);
+    report("build, addChild", secondsSince(start), 0, n);
+
+    {
+        std::vector<std::optional<std::size_t>> parents(n);
+        std::vector<std::any> values(n);
+        std::mt19937 gen(2021);
+        for(std::size_t i = 1; i < n; ++i) {
+            parents[i] = std::uniform_int_distribution<std::size_t>(0, i - 1)(gen);
+            values[i] = makeValue(i);
+        }
+        values[0] = 0;
+
+        start = Clock::now();
+        sds::NaryTree built(sds::TreeBuilder(std::move(parents), std::move(values)));
+        report("build, TreeBuilder", secondsSince(start), 0, n);
+    }
+
+    sds::MemoryUsage usage = tree.memoryUsage();
+    std::printf("memory: %.1f bytes/node (headers %zu, child arrays %zu, payloads %zu)\n\n",
+                static_cast<double>(usage.total()) / static_cast<double>(usage.nodes),
+                usage.node_headers, usage.child_arrays, usage.payloads);
+
+    // Сохранение: блокирующий std::ofstream против конвейера форматирование / запись
+
+    start = Clock::now();
+    {
+        std::ofstream out_file(file_name, std::ios::trunc);
+        tree.saveTree(out_file);
+    }
+    double blocking_save = secondsSince(start);
+    std::size_t bytes = fileSize(file_name);
+    report("save, blocking ofstream", blocking_save, bytes, n);
+
+    start = Clock::now();
+    sds::saveTreeToFile(tree, file_name);
+    report("save, async pipeline", secondsSince(start), bytes, n);
+
+    // Загрузка с холодным page cache: блокирующий std::ifstream против чтения с опережением
+
+    bool cold = dropFileCache(file_name);
+    if(!cold) {
+        std::printf("warning: can't drop page cache, load timings are warm\n");
+    }
+
+    start = Clock::now();
+    {
+        std::ifstream in_file(file_name);
+        sds::NaryTree loaded = sds::NaryTree();
+        loaded.loadTree(in_file);
+    }
+    report("load (cold), blocking ifstream", secondsSince(start), bytes, n);
+
+    dropFileCache(file_name);
+
+    start = Clock::now();
+    {
+        sds::AsyncReadBuf in_buf(file_name);
+        if(!in_buf.isOpen()) {
+            throw std::runtime_error("Can't open file '" + file_name + "' for reading");
+        }
+        std::istream in_file(&in_buf);
+        sds::NaryTree loaded = sds::NaryTree();
+        loaded.loadTree(in_file);
+        in_buf.close();
+    }
+    report("load (cold), async read-ahead", secondsSince(start), bytes, n);
+
+    std::remove(file_name.c_str());
+
+    // Запросы предков: поиск путей обходом против индекса предков
+
+    std::size_t slow_queries = std::max<std::size_t>(1, 2000000 / n), fast_queries = 1000000;
+
+    start = Clock::now();
+    std::size_t checksum = runAncestryQueries(tree, n, slow_queries);
+    reportQueries("ancestry queries, no index", secondsSince(start), slow_queries);
+
+    start = Clock::now();
+    tree.enableAncestryIndex();
+    report("ancestry index build", secondsSince(start), 0, n);
+
+    start = Clock::now();
+    checksum += runAncestryQueries(tree, n, fast_queries);
+    reportQueries("ancestry queries, index", secondsSince(start), fast_queries);
+
+    // Обходы до и после переразмещения дерева в непрерывной памяти
+
+    std::printf("\n");
+    checksum += runWalks(tree, "scattered", n);
+
+    std::pair<sds::Layout, std::string> layouts[] = {
+        {sds::Layout::BreadthFirst, "BFS"}, {sds::Layout::DepthFirst, "DFS"}, {sds::Layout::VanEmdeBoas, "vEB"}
+    };
+    for(auto const& layout: layouts) {
+        start = Clock::now();
+        tree.relayout(layout.first);
+        report("relayout, " + layout.second, secondsSince(start), 0, n);
+        checksum += runWalks(tree, layout.second, n);
+    }
+
+    std::printf("\n(checksum %zu)\n", checksum);
+}
@@ -1,17 +1,25 @@
 #include "nary_tree.hpp"
 #include "utilities.hpp"
+#include "query.hpp"
+#include "tree_image.hpp"
 #include <sstream>
+#include <cstdio>
+#include <cmath>
+#include <thread>
+#include <algorithm>
+#include <functional>
+#include <random>
 
 int main()
 {
     sds::NaryTree tree1 = sds::NaryTree();
     assert(tree1.getNodesVector().size() == 1);
     assert(std::any_cast<std::string>(tree1.getRoot()->getData()) == "Dummy Node");
-    std::cout << "[1/4] Passed empty tree test\n";
+    std::cout << "[1/15] Passed empty tree test\n";
 
     sds::NaryTree tree2 = sds::makeSampleTree();
     assert(tree2.getNodesVector().size() == 13);
-    std::cout << "[2/4] Passed many nodes tree test\n";
+    std::cout << "[2/15] Passed many nodes tree test\n";
 
     std::ostringstream os;
     tree2.saveTree(os);
@@ -19,7 +27,7 @@ int main()
     test_string += "{1} 30:2015\n{1} 60:4:2015\n{2} 60:3:foo\n{2} 50:6.28318\n{3} 30:9\n{7} 60:5:hello\n";
     test_string += "{8} 60:4:Hey!\n{8} 60:3:Bye\n{9} 50:3.14159";
     assert(os.str() == test_string);
-    std::cout << "[3/4] Passed save tree test\n";
+    std::cout << "[3/15] Passed save tree test\n";
 
     std::istringstream is(os.str());
     sds::NaryTree tree3 = sds::NaryTree();
@@ -28,5 +36,454 @@ int main()
     assert(std::any_cast<std::string>(tree3.findNodeById(2)->getData()) == "baz");
     assert(std::any_cast<double>(tree3.findNodeById(3)->getData()) == 2.015);
     assert(std::any_cast<int>(tree3.findNodeById(8)->getData()) == 9);
-    std::cout << "[4/4] Passed load tree test\n";
-}
\ No newline at end of file
+    std::cout << "[4/15] Passed load tree test\n";
+
+    std::ostringstream snapshot_os, index_os;
+    tree2.saveTree(snapshot_os, index_os);
+    assert(snapshot_os.str() == test_string);
+    std::istringstream index_is(index_os.str()), scan_is(snapshot_os.str());
+    sds::SnapshotIndex index = sds::SnapshotIndex::load(index_is);
+    sds::SnapshotIndex scanned = sds::SnapshotIndex::build(scan_is);
+    assert(index.size() == 13 && scanned.size() == 13);
+    assert(index.snapshotSize() == test_string.size() && scanned.snapshotSize() == test_string.size());
+    assert(index[7].offset == scanned[7].offset && index[7].first_kid == 9 && index[7].kids_count == 1);
+    std::istringstream snapshot_is(snapshot_os.str());
+    sds::NaryTree tree4 = sds::NaryTree();
+    tree4.loadSubtree(snapshot_is, index, 1, 1);
+    assert(tree4.getNodesVector().size() == 4);
+    assert(tree4.getRoot()->getId() == 1 && !tree4.getRoot()->getParent());
+    assert(std::any_cast<double>(tree4.findNodeById(3)->getData()) == 2.015);
+    assert(tree4.findNodeById(8) == nullptr);
+    sds::NaryTree tree5 = sds::NaryTree();
+    tree5.loadSubtree(snapshot_is, 2);
+    assert(tree5.getNodesVector().size() == 5);
+    assert(std::any_cast<double>(tree5.findNodeById(12)->getData()) == 3.14159);
+    assert(tree5.findNodeById(12)->getLevel() == 3);
+    for(std::string corrupt: {std::string(":9:99999999999999"), std::string(":42:1")}) {
+        std::string index_text = index_os.str();                    // запись 7 с испорченными потомками
+        std::size_t entry_begin = 0;
+        for(int line = 0; line != 2 + 7; ++line) {
+            entry_begin = index_text.find(sds::EOL, entry_begin) + 1;
+        }
+        std::size_t offset_end = index_text.find(sds::DELIM, entry_begin);
+        index_text.replace(offset_end, index_text.find(sds::EOL, entry_begin) - offset_end, corrupt);
+        std::istringstream corrupt_is(index_text);
+        bool corrupt_rejected = false;
+        try {
+            sds::SnapshotIndex::load(corrupt_is);
+        }
+        catch(sds::DeserialisationException const& ) {
+            corrupt_rejected = true;
+        }
+        assert(corrupt_rejected);
+    }
+    const std::string file_name = "nary_tree_tests.tmp";
+    sds::saveTreeToFile(tree2, file_name, true);
+    sds::NaryTree tree7 = sds::NaryTree();
+    sds::loadSubtreeFromFile(tree7, file_name, 8);
+    assert(tree7.getNodesVector().size() == 3);
+    {
+        std::ofstream stale_file(file_name, std::ios::trunc);      // снимок меняется в обход индекса
+        sds::makeSampleTree().extractSubtree(tree2.findNodeById(2)).saveTree(stale_file);
+    }
+    bool stale_index_rejected = false;
+    try {
+        sds::NaryTree stale = sds::NaryTree();
+        sds::loadSubtreeFromFile(stale, file_name, 1);
+    }
+    catch(sds::DeserialisationException const& ) {
+        stale_index_rejected = true;
+    }
+    assert(stale_index_rejected);
+    sds::saveTreeToFile(tree2, file_name);                         // без индекса: старый sidecar удаляется
+    assert(!std::ifstream(file_name + sds::INDEX_EXT));
+    sds::NaryTree unindexed = sds::NaryTree();
+    sds::loadSubtreeFromFile(unindexed, file_name, 8);
+    assert(unindexed.getNodesVector().size() == 3);
+    std::remove(file_name.c_str());
+    std::cout << "[5/15] Passed partial load tree test\n";
+
+    std::ostringstream async_index_os;
+    {
+        sds::AsyncWriteBuf out_buf(file_name, 8, 2);
+        std::ostream out_file(&out_buf);
+        tree2.saveTree(out_file, async_index_os);
+        out_buf.close();
+    }
+    assert(async_index_os.str() == index_os.str());
+    sds::AsyncReadBuf in_buf(file_name, 8, 2);
+    std::istream in_file(&in_buf);
+    sds::NaryTree tree6 = sds::NaryTree();
+    tree6.loadTree(in_file);
+    in_buf.close();
+    assert(tree6.getNodesVector().size() == 13);
+    assert(std::any_cast<std::string>(tree6.findNodeById(10)->getData()) == "Hey!");
+    sds::AsyncReadBuf missing_in_buf("/nonexistent/" + file_name, 8, 2);   // не открылся: EOF, а не ожидание
+    std::istream missing_in(&missing_in_buf);
+    std::string missing_line;
+    std::getline(missing_in, missing_line);
+    assert(!missing_in_buf.isOpen() && missing_in.fail() && missing_line.empty());
+    sds::AsyncWriteBuf missing_out_buf("/nonexistent/" + file_name, 8, 2);
+    std::ostream missing_out(&missing_out_buf);
+    missing_out << std::string(40, 'x');
+    assert(!missing_out_buf.isOpen() && missing_out.bad());
+    bool missing_reported = false;
+    try {
+        missing_out_buf.close();
+    }
+    catch(std::runtime_error const& ) {
+        missing_reported = true;
+    }
+    assert(missing_reported);
+    std::remove(file_name.c_str());
+    std::cout << "[6/15] Passed async file IO test\n";
+
+    std::vector<std::optional<std::size_t>> parents = {2, std::nullopt, 1, 1, 0};
+    std::vector<std::any> values = {std::make_any<int>(10), std::make_any<std::string>("top"),
+                                    std::make_any<double>(1.5), std::make_any<char>('x'),
+                                    std::make_any<long>(7L)};
+    sds::NaryTree tree8(sds::TreeBuilder(std::move(parents), std::move(values)));
+    assert(tree8.getRoot()->getId() == 1);
+    assert(tree8.getNodesVector().size() == 5);
+    assert(tree8.findNodeById(4)->getLevel() == 3 && tree8.findNodeById(3)->getLevel() == 1);
+    assert(std::any_cast<long>(tree8.findNodeById(4)->getData()) == 7L);
+    assert(tree8.getNodesVector()[1]->getId() == 2 && tree8.getNodesVector()[2]->getId() == 3);
+    sds::Node::PointerType root8 = tree8.getRoot();
+    sds::Node::PointerType added8 = tree8.addChild(root8, std::make_any<int>(1));
+    assert(added8->getId() == 5);
+    bool thrown = false;
+    try {
+        sds::TreeBuilder builder;
+        builder.add(std::make_any<int>(1), std::nullopt);
+        builder.add(std::make_any<int>(2), 5);
+        builder.build();
+    }
+    catch(sds::BadTreeStructure const& ) { thrown = true; }
+    assert(thrown);
+    thrown = false;
+    try {
+        std::vector<std::pair<std::any, std::optional<std::size_t>>> nodes = {
+            {std::make_any<int>(1), std::nullopt}, {std::make_any<int>(2), 2}, {std::make_any<int>(3), 1}};
+        sds::TreeBuilder(nodes.begin(), nodes.end()).build();
+    }
+    catch(sds::BadTreeStructure const& ) { thrown = true; }
+    assert(thrown);
+    std::cout << "[7/15] Passed tree builder test\n";
+
+    sds::NaryTree tree9 = sds::makeSampleTree();
+    assert(tree9.isAncestor(1, 10) && !tree9.isAncestor(2, 10) && tree9.isAncestor(4, 4));
+    assert(tree9.lca(10, 5)->getId() == 1 && tree9.lca(12, 4)->getId() == 0);
+    assert(tree9.pathToRoot(12).size() == 5 && tree9.pathToRoot(12)[1]->getId() == 9);
+    tree9.enableAncestryIndex();
+    assert(tree9.isAncestor(1, 10) && !tree9.isAncestor(2, 10) && tree9.isAncestor(4, 4));
+    assert(!tree9.isAncestor(10, 1));
+    assert(tree9.lca(10, 5)->getId() == 1 && tree9.lca(12, 4)->getId() == 0 && tree9.lca(11, 8)->getId() == 8);
+    assert(tree9.pathToRoot(12).size() == 5 && tree9.pathToRoot(12)[1]->getId() == 9);
+    assert(std::any_cast<int>(tree9.findNodeById(8)->getData()) == 9);
+    sds::Node::PointerType node12 = tree9.findNodeById(12);
+    sds::Node::PointerType node13 = tree9.addChild(node12, std::make_any<int>(13));
+    assert(tree9.hasAncestryIndex() && tree9.isAncestor(2, node13->getId()));
+    assert(tree9.lca(node13->getId(), 6)->getId() == 2 && tree9.pathToRoot(node13->getId()).size() == 6);
+    tree9.renumberAncestryIndex();
+    assert(tree9.isAncestor(7, node13->getId()) && !tree9.isAncestor(1, node13->getId()));
+    sds::Node::PointerType chain = tree9.getRoot();
+    for(int i = 0; i != 40; ++i) {
+        chain = tree9.addChild(chain, std::make_any<int>(i));
+    }
+    assert(tree9.lca(chain->getId(), node13->getId())->getId() == 0);
+    assert(tree9.isAncestor(chain->getId() - 30, chain->getId()) && tree9.pathToRoot(chain->getId()).size() == 41);
+    std::cout << "[8/15] Passed ancestry index test\n";
+
+    sds::NaryTree tree10 = sds::makeSampleTree();
+    assert(tree10.subtreeSize(1) == 7 && tree10.subtreeHeight(1) == 3 && std::abs(tree10.subtreeSum(2) - 9.42477) < 1e-9);
+    assert(tree10.subtreeMin(1) == 2.015 && tree10.subtreeMax(10) == -std::numeric_limits<double>::infinity());
+    assert(tree10.subtreeIntegerSum(1) == 2024 && tree10.subtreeSize(12) == 1);
+    tree10.enableAggregates();
+    assert(tree10.subtreeSize(0) == 13 && tree10.subtreeSize(1) == 7 && tree10.subtreeSize(12) == 1);
+    assert(tree10.subtreeHeight(0) == 4 && tree10.subtreeHeight(2) == 3 && tree10.subtreeHeight(5) == 0);
+    assert(tree10.subtreeSum(3) == 2.015 + 9 && tree10.subtreeMin(0) == 2.015 && tree10.subtreeMax(1) == 2015);
+    assert(tree10.subtreeMax(10) == -std::numeric_limits<double>::infinity());
+    std::size_t strings = tree10.registerAggregate({"strings", 0,
+        [](sds::Node const& node) { return node.getDataIf<std::string>() ? 1.0 : 0.0; },
+        [](double a, double b) { return a + b; }});
+    assert(tree10.aggregate(0, strings) == 7 && tree10.aggregate(2, strings) == 3);
+    sds::Node::PointerType node10 = tree10.findNodeById(10);
+    sds::Node::PointerType node14 = tree10.addChild(node10, std::make_any<long>(-5L));
+    tree10.addChild(node14, std::make_any<std::string>("deep"));
+    assert(tree10.subtreeSize(0) == 15 && tree10.subtreeHeight(0) == 6 && tree10.subtreeHeight(8) == 3);
+    assert(tree10.subtreeMin(1) == -5 && tree10.subtreeSum(8) == 4 && tree10.aggregate(3, strings) == 3);
+    sds::Node::PointerType long_parent = tree10.findNodeById(12);
+    tree10.addChild(long_parent, std::make_any<long>((1L << 53) + 1));   // не представимо в double
+    tree10.addChild(long_parent, std::make_any<long>(2L));
+    assert(tree10.subtreeIntegerSum(0) == (1L << 53) + 2030 && tree10.subtreeIntegerSum(12) == (1L << 53) + 3);
+    assert(tree10.extractSubtree(long_parent).subtreeIntegerSum(0) == (1L << 53) + 3);
+    std::istringstream load_is(test_string);
+    tree10.loadTree(load_is);
+    assert(tree10.subtreeSize(0) == 13 && tree10.aggregate(0, strings) == 7);
+    std::cout << "[9/15] Passed subtree aggregates test\n";
+
+    sds::NaryTree tree11 = sds::makeSampleTree();
+    sds::Node::PointerType root11 = tree11.getRoot();
+    tree11.addChild(root11, std::make_any<std::string>(std::string(100, 'a')));
+    sds::MemoryUsage usage = tree11.memoryUsage();
+    assert(usage.nodes == 14 && usage.node_headers >= 14 * sizeof(sds::Node) && usage.indexes == 0);
+    assert(usage.child_arrays >= 13 * sizeof(sds::Node::PointerType));
+    assert(usage.payloads == 8 * sizeof(std::string) + 101);
+    tree11.enableAncestryIndex();
+    assert(tree11.memoryUsage().indexes > 0);
+    assert(usage.total() == usage.node_headers + usage.child_arrays + usage.payloads);
+    assert(!tree11.getRoot()->getParent() && tree11.findNodeById(12)->getParent() == 9u);
+#ifdef SDS_COMPACT_NODES
+    assert(sizeof(sds::Node) < sizeof(std::any) + sizeof(sds::Node::KidsContainerType) + 4 * sizeof(std::size_t));
+#endif
+    std::cout << "[10/15] Passed memory usage test\n";
+
+    std::vector<std::size_t> max_ids(4, 0);
+    std::vector<std::thread> threads;
+    for(std::size_t t = 0; t != max_ids.size(); ++t) {
+        threads.emplace_back([&max_ids, &test_string, t]() {
+            for(int i = 0; i != 50; ++i) {
+                std::istringstream thread_is(test_string);
+                sds::NaryTree thread_tree = sds::NaryTree();
+                thread_tree.loadTree(thread_is);
+                sds::Node::PointerType thread_root = thread_tree.getRoot();
+                max_ids[t] = std::max(max_ids[t], thread_tree.addChild(thread_root, std::make_any<int>(i))->getId());
+            }
+        });
+    }
+    for(std::thread& thread: threads) {
+        thread.join();
+    }
+    assert(max_ids == std::vector<std::size_t>(4, 13));
+    sds::NaryTree first_tree = sds::makeSampleTree();
+    first_tree.enableAncestryIndex();
+    sds::NaryTree second_tree = sds::NaryTree();                   // у каждого дерева свой счетчик id
+    sds::Node::PointerType first_root = first_tree.getRoot();
+    sds::Node::PointerType first_added = first_tree.addChild(first_root, std::make_any<int>(99));
+    assert(first_added->getId() == 13);
+    std::thread([&first_tree, &first_root, &first_added]() {
+        first_added = first_tree.addChild(first_root, std::make_any<int>(100));
+    }).join();
+    assert(first_added->getId() == 14);
+    assert(std::any_cast<std::string>(first_tree.findNodeById(1)->getData()) == "bar");
+    first_tree.enableAggregates();
+    sds::NaryTree copied_tree = first_tree;                        // копия глубокая
+    sds::Node::PointerType copied_root = copied_tree.getRoot();
+    sds::Node::PointerType copied_kid = copied_tree.addChild(copied_root, std::make_any<int>(101));
+    sds::Node::PointerType first_kid = first_tree.addChild(first_root, std::make_any<int>(102));
+    assert(copied_kid->getId() == 15 && first_kid->getId() == 15 && copied_root != first_root);
+    assert(copied_tree.subtreeSize(0) == 16 && first_tree.subtreeSize(0) == 16);
+    assert(std::any_cast<int>(first_tree.findNodeById(15)->getData()) == 102);
+    assert(std::any_cast<int>(copied_tree.findNodeById(15)->getData()) == 101 && copied_tree.isAncestor(0, 15));
+    copied_tree = second_tree;
+    assert(copied_tree.getNodesVector().size() == 1 && copied_tree.getRoot() != second_tree.getRoot());
+    std::cout << "[11/15] Passed concurrent trees test\n";
+
+    sds::NaryTree tree12 = sds::makeSampleTree();
+    sds::NaryTree subtree = tree12.extractSubtree(tree12.findNodeById(2));
+    std::ostringstream subtree_os;
+    subtree.saveTree(subtree_os);
+    assert(subtree_os.str() == "sds:1\n{root} 60:3:baz\n{0} 60:3:foo\n{0} 50:6.28318\n{2} 60:5:hello\n{3} 50:3.14159");
+    assert(subtree.findNodeById(4)->getLevel() == 3 && tree12.findNodeById(12)->getLevel() == 4);
+    std::vector<sds::Shard> shards = tree12.shard(3);
+    std::size_t sharded_nodes = 0;
+    for(sds::Shard& shard: shards) {
+        sharded_nodes += shard.tree.getNodesVector().size() - (shard.count > 1);
+        assert(shard.tree.getNodesVector().size() - (shard.count > 1) <= 5);
+    }
+    assert(shards.size() == 3 && sharded_nodes == 13 && !shards[0].parent_shard && shards[0].root_id == 0);
+    sds::NaryTree merged = sds::NaryTree::merge(std::move(shards));
+    std::ostringstream merged_os;
+    merged.saveTree(merged_os);
+    assert(merged_os.str() == test_string);
+    std::vector<sds::Shard> file_shards = tree12.shard(4);
+    sds::saveShardsToFiles(file_shards, file_name);
+    sds::NaryTree file_merged = sds::mergeShardsFromFiles(file_name + sds::SHARDS_EXT);
+    std::ostringstream file_merged_os;
+    file_merged.saveTree(file_merged_os);
+    assert(file_merged_os.str() == test_string);
+    for(std::size_t s = 0; s != file_shards.size(); ++s) {
+        std::remove((file_name + "." + std::to_string(s)).c_str());
+        for(std::size_t j = 0; file_shards[s].count > 1 && j != file_shards[s].count; ++j) {
+            std::remove((file_name + "." + std::to_string(s) + "." + std::to_string(j)).c_str());
+        }
+    }
+    std::remove((file_name + sds::SHARDS_EXT).c_str());
+    std::mt19937 shard_gen(2021);                                   // случайное дерево и "звезда" по 10000 узлов
+    sds::NaryTree random_tree(std::make_any<int>(0), std::nullopt, 0), star_tree(std::make_any<int>(0), std::nullopt, 0);
+    std::vector<sds::Node::PointerType> random_nodes(1, random_tree.getRoot());
+    sds::Node::PointerType star_root = star_tree.getRoot();
+    for(int i = 1; i != 10000; ++i) {
+        std::uniform_int_distribution<std::size_t> parent(0, random_nodes.size() - 1);
+        random_nodes.push_back(random_tree.addChild(random_nodes[parent(shard_gen)], std::make_any<int>(i)));
+        star_tree.addChild(star_root, std::make_any<int>(i));
+    }
+    for(sds::NaryTree* sharded: {&random_tree, &star_tree}) {
+        std::vector<sds::Shard> balanced = sharded->shard(8);
+        std::size_t largest = 0;
+        for(sds::Shard& shard: balanced) {
+            largest = std::max(largest, shard.tree.getNodesVector().size() - (shard.count > 1));
+        }
+        assert(balanced.size() <= 8 && largest <= 1250 * 5 / 4);
+        assert(sharded != &star_tree || (balanced.size() == 8 && largest == 1250));
+        std::ostringstream sharded_os, balanced_os;
+        sharded->saveTree(sharded_os);
+        sds::saveShardsToFiles(balanced, file_name);
+        sds::mergeShardsFromFiles(file_name + sds::SHARDS_EXT).saveTree(balanced_os);
+        assert(balanced_os.str() == sharded_os.str());
+        for(std::size_t s = 0; s != balanced.size(); ++s) {
+            std::string shard_file = file_name + "." + std::to_string(s);
+            assert((balanced[s].count == 1) == std::ifstream(shard_file).good());  // серия - без заглушки
+            std::remove(shard_file.c_str());
+            for(std::size_t j = 0; balanced[s].count > 1 && j != balanced[s].count; ++j) {
+                std::remove((shard_file + "." + std::to_string(j)).c_str());
+            }
+        }
+        std::remove((file_name + sds::SHARDS_EXT).c_str());
+    }
+    std::cout << "[12/15] Passed subtree extraction and sharding test\n";
+
+    sds::NaryTree tree13 = sds::makeSampleTree();
+    tree13.enableAncestryIndex();
+    sds::QueryPlan doubles = sds::Query().under(0).type(sds::NodeType::Double).level(2).greater(2.0).compile(tree13);
+    std::vector<sds::Node::PointerType> found = doubles.collect();
+    assert(found.size() == 2 && found[0]->getId() == 3 && found[1]->getId() == 7);
+    assert(doubles.stats().visited == 8 && doubles.stats().matched == 2);
+    assert(doubles.explain().find("ancestry index") != std::string::npos);
+    found = sds::Query().parentType(sds::NodeType::Int).startsWith("b").compile(tree13).collect();
+    assert(found.size() == 2 && found[0]->getId() == 1 && found[1]->getId() == 2);
+    found = sds::Query().under(8).parentType(sds::NodeType::Int).startsWith("B").compile(tree13).collect();
+    assert(found.size() == 1 && found[0]->getId() == 11);
+    sds::QueryPlan contradiction = sds::Query().level(3).maxLevel(2).compile(tree13);
+    assert(contradiction.collect().empty() && contradiction.stats().visited == 0);
+    tree13.enableAggregates();
+    sds::QueryPlan big = sds::Query().greater(100).compile(tree13);
+    found = big.collect();
+    assert(found.size() == 1 && found[0]->getId() == 4);
+    assert(big.stats().pruned >= 3 && big.stats().visited < 13);
+    std::size_t streamed = 0;
+    sds::QueryStats stats = sds::Query().where([](sds::Node const& node) { return node.getLevel() % 2 == 0; })
+        .compile(tree13).run([&streamed](sds::Node::PointerType const& ) { return ++streamed < 3; });
+    assert(streamed == 3 && stats.matched == 3);
+    sds::NaryTree growing = sds::makeSampleTree();                 // on_match перевыделяет буферы kids
+    std::vector<std::size_t> grown;
+    stats = sds::Query().where([](sds::Node const& node) {
+        return node.getLevel() == 2 && node.getType() != typeid(int);
+    }).compile(growing).run([&growing, &grown](sds::Node::PointerType const& node) {
+        sds::Node::PointerType parent = growing.findNodeById(*node->getParent());
+        for(int i = 0; i != 64; ++i) {
+            growing.addChild(parent, std::make_any<int>(i));
+        }
+        grown.push_back(node->getId());
+        return true;
+    });
+    assert((grown == std::vector<std::size_t>{3, 5, 6, 7}) && growing.getNodesVector().size() == 13 + 4 * 64);
+    std::cout << "[13/15] Passed query engine test\n";
+
+    sds::NaryTree tree14 = sds::makeSampleTree();
+    tree14.enableAncestryIndex();
+    tree14.enableAggregates();
+    // id узлов в порядке их адресов в памяти
+    auto addressOrder = [](sds::NaryTree& tree) {
+        std::vector<sds::Node::PointerType> nodes = tree.getNodesVector();
+        std::sort(nodes.begin(), nodes.end(), [](sds::Node::PointerType const& a, sds::Node::PointerType const& b) {
+            return std::less<sds::Node const*>()(a.get(), b.get());
+        });
+        std::vector<std::size_t> ids;
+        for(sds::Node::PointerType const& node: nodes) {
+            ids.push_back(node->getId());
+        }
+        return ids;
+    };
+    std::pair<sds::Layout, std::vector<std::size_t>> layouts[] = {
+        {sds::Layout::BreadthFirst, {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12}},
+        {sds::Layout::DepthFirst, {0, 1, 3, 8, 10, 11, 4, 5, 2, 6, 7, 9, 12}},
+        {sds::Layout::VanEmdeBoas, {0, 1, 2, 3, 8, 10, 11, 4, 5, 6, 7, 9, 12}}
+    };
+    for(auto const& layout: layouts) {
+        tree14.relayout(layout.first);
+        assert(addressOrder(tree14) == layout.second);
+        std::ostringstream relayout_os;
+        tree14.saveTree(relayout_os);
+        assert(relayout_os.str() == test_string);
+        assert(tree14.findNodeById(12)->getLevel() == 4 && tree14.isAncestor(2, 12) && tree14.subtreeSize(1) == 7);
+    }
+    sds::Node::PointerType node9 = tree14.findNodeById(9);
+    sds::Node::PointerType added14 = tree14.addChild(node9, std::make_any<int>(14));
+    assert(added14->getId() == 13 && tree14.subtreeSize(0) == 14);
+    tree14.compact();
+    assert(std::any_cast<std::string>(node9->getData()) == "hello");        // устаревший указатель читаем
+    bool stale_rejected = false;
+    try {
+        tree14.addChild(node9, std::make_any<int>(5));
+    }
+    catch(std::runtime_error const& ) {
+        stale_rejected = true;
+    }
+    assert(stale_rejected && tree14.subtreeSize(0) == 14);
+    sds::NaryTree stale_tree = sds::makeSampleTree();
+    stale_tree.enableAggregates();
+    sds::Node::PointerType stale8 = stale_tree.findNodeById(8);
+    stale_tree.compact();
+    stale_rejected = false;
+    try {
+        stale_tree.addChild(stale8, std::make_any<int>(5));
+    }
+    catch(std::runtime_error const& ) {
+        stale_rejected = true;
+    }
+    assert(stale_rejected && stale_tree.subtreeSize(0) == stale_tree.getNodesVector().size());
+    sds::NaryTree plain_tree = sds::makeSampleTree();               // без индексов
+    sds::Node::PointerType plain9 = plain_tree.findNodeById(9);
+    sds::QueryPlan plain_strings = sds::Query().under(2).type(sds::NodeType::String).compile(plain_tree);
+    plain_tree.compact();
+    assert(plain9->isDetached() && !plain_tree.findNodeById(9)->isDetached());
+    stale_rejected = false;
+    try {
+        plain_tree.addChild(plain9, std::make_any<int>(5));
+    }
+    catch(std::runtime_error const& ) {
+        stale_rejected = true;
+    }
+    assert(stale_rejected && plain_tree.getNodesVector().size() == 13);
+    assert(plain_strings.collect().size() == 3);                   // "baz", "foo", "hello"
+    assert(tree14.memoryUsage().node_headers >=
+           14 * (sizeof(sds::Node) + 2 * sizeof(void*) + sizeof(sds::ArenaAllocator<sds::Node>)));
+    assert(tree14.getNodesVector().size() == 14 && tree14.findNodeById(13)->getLevel() == 4);
+    std::cout << "[14/15] Passed relayout test\n";
+
+    sds::NaryTree tree15 = sds::makeSampleTree();
+    std::string image_name = file_name + ".img";
+    sds::TreeImage::publish(tree15, image_name);
+    sds::TreeImage image = sds::TreeImage::attach(image_name);
+    assert(image.size() == 13 && image.getRoot().getValue<int>() == 8 && image.getRoot().kidsCount() == 2);
+    assert(image.findNodeById(12)->getValue<double>() == 3.14159 && image.findNodeById(12)->getLevel() == 4);
+    assert(image.findNodeById(9)->getValue<std::string_view>() == "hello" && !image.findNodeById(9)->getValue<int>());
+    assert(image.findNodeById(11)->getParent() == 8 && image.getRoot().kid(1).kid(0).getValue<std::string_view>() == "foo");
+    assert(!image.findNodeById(13));
+    std::size_t image_ids = 0;
+    for(sds::TreeImage::NodeView const& node: image.getNodesVector()) {
+        image_ids += node.getId();
+    }
+    assert(image_ids == 78);
+    sds::Node::PointerType root15 = tree15.getRoot();
+    tree15.addChild(root15, std::make_any<long>(15));              // id 13, но третий в порядке обхода
+    sds::TreeImage::publish(tree15, image_name);
+    sds::TreeImage republished = sds::TreeImage::attach(image_name);
+    assert(image.size() == 13 && republished.size() == 14);         // подключенный образ не меняется
+    assert(republished.findNodeById(13)->getValue<long>() == 15 && republished.getRoot().kid(2).getId() == 13);
+    assert(republished.findNodeById(3)->getValue<double>() == 2.015);
+    std::remove(image_name.c_str());
+    std::string shm_name = "/sds_test_" + std::to_string(::getpid());
+    sds::TreeImage::publishShared(tree15, shm_name);
+    sds::TreeImage shared = sds::TreeImage::attachShared(shm_name);
+    sds::TreeImage::unlinkShared(shm_name);
+    assert(shared.size() == 14 && shared.findNodeById(10)->getValue<std::string_view>() == "Hey!");
+    std::vector<sds::TreeImage> images;
+    images.push_back(std::move(shared));
+    sds::TreeImage::NodeView moved_view = images.back().getRoot().kid(0);
+    images.push_back(std::move(republished));                       // перемещает первый образ
+    assert(moved_view.kid(0).getValue<double>() == 2.015 && moved_view.getParent() == 0);
+    assert(images.front().findNodeById(10)->getValue<std::string_view>() == "Hey!");
+    std::cout << "[15/15] Passed tree image test\n";
+}
@@ -16,6 +16,9 @@
 #include <iomanip>
 #include <iostream>
 #include <optional>
+#include <limits>
+#include <cstdint>
+#include <stdexcept>
 
 namespace sds {
 
@@ -139,12 +142,29 @@ namespace sds {
         // Контейнер для ссылок на дочерние элементы.
         using KidsContainerType = std::vector<PointerType>;
 
+        // Типы полей узла. С SDS_COMPACT_NODES id хранятся в 32 битах, уровень - в 16
+        // (sizeof(Node) 56 байт вместо 72), иначе - в std::size_t.
+#ifdef SDS_COMPACT_NODES
+        using IdType = std::uint32_t;
+        using LevelType = std::uint16_t;
+#else
+        using IdType = std::size_t;
+        using LevelType = std::size_t;
+#endif
+        // Значение поля parent у корня (вместо std::optional); id узлов всегда меньше него.
+        static constexpr IdType NO_PARENT = std::numeric_limits<IdType>::max();
+        // id узла, отсоединенного от дерева переразмещением (см. NaryTree::relayout).
+        static constexpr IdType DETACHED_ID = std::numeric_limits<IdType>::max();
+
     private:
         friend class NaryTree;
+        friend class TreeBuilder;
+        friend class AncestryIndex;
+        friend class SubtreeAggregates;
+        friend class QueryPlan;
+        friend class TreeImage;
 
-        inline static std::size_t counter = 0;  // счетчик созданных узлов
-        std::size_t id;                         // id узла
-        std::optional<std::size_t> parent;      // id родителя
+        // Поля упорядочены по убыванию выравнивания, чтобы не было дыр
         std::any data;                          // данные
         /*  Выбрал std::any из соображений экономии памяти:
             sizeof(struct for node) = 80
@@ -152,47 +172,51 @@ namespace sds {
             sizeof(any) = 16
             и возможности runtime определения фактического типа значения
         */
-        NodeType type;                          // тип хранимого значения
-        std::size_t level;                      // уровень узла в дереве: 0/1/... (номер строки для вывода на экран)
         KidsContainerType kids;                 // дочерние узлы          
+        IdType id;                              // id узла
+        IdType parent;                          // id родителя (NO_PARENT для корня)
+        LevelType level;                        // уровень узла в дереве: 0/1/... (номер строки для вывода на экран)
+        NodeType type;                          // тип хранимого значения
 
-    public:
-        // Структоры
-        Node(bool reset_counter = false): id(Node::counter++), parent(std::nullopt), 
-            data(std::make_any<std::string>("Dummy Node")), 
-            type(getNodeTypeFromAny(data)), level(0), kids() 
-        {   
-            // при создании нового дерева обнуляем счетчик id класса узлов
-            if(reset_counter) {
-                id = 0;
-                counter = 1;
+        // Проверяет, что id помещается в IdType.
+        static IdType toId(std::size_t id)
+        {
+            if(id >= NO_PARENT) {
+                throw std::overflow_error("Node ID " + std::to_string(id) + " doesn't fit the node layout");
             }
+            return static_cast<IdType>(id);
         }
-        Node(std::any const& any, std::optional<std::size_t> const& parent, std::size_t level, bool reset_counter = false): 
-            id(Node::counter++), parent(parent), data(any), type(getNodeTypeFromAny(data)), level(level), kids()
+        // Проверяет, что уровень помещается в LevelType.
+        static LevelType toLevel(std::size_t level)
         {
-            // при создании нового дерева обнуляем счетчик id класса узлов
-            if(reset_counter) {
-                id = 0;
-                counter = 1;
+            if(level > std::numeric_limits<LevelType>::max()) {
+                throw std::overflow_error("Node level " + std::to_string(level) + " doesn't fit the node layout");
             }
+            return static_cast<LevelType>(level);
         }
-        Node(std::any && any, std::optional<std::size_t> && parent, std::size_t level, bool reset_counter = false): 
-            id(Node::counter++), parent(parent), data(std::move(any)), type(getNodeTypeFromAny(data)), 
-            level(level), kids()
+        // Возвращает значение поля parent для id родителя.
+        static IdType toParent(std::optional<std::size_t> const& parent)
         {
-            // при создании нового дерева обнуляем счетчик id класса узлов
-            if(reset_counter) {
-                id = 0;
-                counter = 1;
-            }
+            return parent ? toId(*parent) : NO_PARENT;
         }
+
+    public:
+        // Структоры
+        // id узла выдает дерево (см. NaryTree::next_id); отдельно созданный узел имеет id 0.
+        Node(): data(std::make_any<std::string>("Dummy Node")), kids(), id(0), parent(NO_PARENT), level(0),
+            type(getNodeTypeFromAny(data)) {}
+        Node(std::any const& any, std::optional<std::size_t> const& parent, std::size_t level): 
+            data(any), kids(), id(0), parent(toParent(parent)), level(toLevel(level)), type(getNodeTypeFromAny(data)) {}
+        Node(std::any && any, std::optional<std::size_t> && parent, std::size_t level): 
+            data(std::move(any)), kids(), id(0), parent(toParent(parent)), level(toLevel(level)),
+            type(getNodeTypeFromAny(data)) {}
         Node(Node const& other):
-            id(Node::counter++), parent(other.parent), data(other.data), type(other.type), level(other.level), 
-            kids(other.kids) {}
+            data(other.data), kids(other.kids), id(other.id), parent(other.parent), level(other.level),
+            type(other.type) {}
+        // перемещение переносит тот же узел: id сохраняется (исключений нет)
         Node(Node && other) noexcept: 
-            id(Node::counter++), parent(std::move(other.parent)), data(std::move(other.data)), type(other.type), 
-            level(other.level), kids(std::move(other.kids)) {}
+            data(std::move(other.data)), kids(std::move(other.kids)), id(other.id), parent(other.parent),
+            level(other.level), type(other.type) {}
         ~Node() = default;
 
         // Присваивание
@@ -209,11 +233,6 @@ namespace sds {
             kids.swap(other.kids);
             return *this;
         }
-        // Обнуляет счетчик id класса узлов (для конструирования нового дерева)
-        static void resetNodeCounter(std::size_t new_counter = 0)
-        {
-            counter = new_counter;
-        }
 
         // Запросы
         bool isEmpty() const noexcept {
@@ -225,8 +244,12 @@ namespace sds {
         std::size_t getId() const noexcept {
             return id;
         }
+        // Отсоединен ли узел от дерева (устаревший указатель после переразмещения).
+        bool isDetached() const noexcept {
+            return id == DETACHED_ID;
+        }
         std::optional<size_t> getParent() const noexcept {
-            return parent;
+            return parent == NO_PARENT ? std::nullopt : std::make_optional<std::size_t>(parent);
         }
         std::size_t getLevel() const noexcept {
             return level;
@@ -234,6 +257,26 @@ namespace sds {
         std::any getData() const noexcept {
             return data;
         }
+        // Возвращает число байт, которые данные узла занимают вне самого узла (в куче).
+        std::size_t payloadBytes() const noexcept
+        {
+            if(std::string const* string = getDataIf<std::string>()) {
+                // std::string не помещается во внутренний буфер std::any, а длинная строка
+                // не помещается и во внутренний буфер самой std::string
+                static const std::size_t sso_capacity = std::string().capacity();
+                std::size_t bytes = sizeof(std::string);
+                if(string->capacity() > sso_capacity) {
+                    bytes += string->capacity() + 1;
+                }
+                return bytes;
+            }
+            return 0;   // char, int, long и double хранятся внутри std::any
+        }
+        // Возвращает указатель на данные узла, если они типа T, иначе nullptr (без копирования).
+        template <typename T>
+        T const* getDataIf() const noexcept {
+            return std::any_cast<T>(&data);
+        }
 
         // IO
         friend std::ostream& operator<<(std::ostream& os, const Node& node)
@@ -245,8 +288,8 @@ namespace sds {
 
             // вывод id родителя
             os << "{";
-            if(node.parent) {
-                os << *node.parent;
+            if(node.parent != NO_PARENT) {
+                os << node.parent;
             }
             else {
                 os << ROOT_STR;
@@ -263,6 +306,21 @@ namespace sds {
 
             return os;
         }
+        // Сериализует узел как запись снимка дерева.
+        // Аргументы:
+        // os - поток для вывода
+        // parent_record - номер записи родителя в снимке (std::nullopt для корня)
+        void writeRecord(std::ostream& os, std::optional<std::size_t> const& parent_record) const
+        {
+            os << "{";
+            if(parent_record) {
+                os << *parent_record;
+            }
+            else {
+                os << ROOT_STR;
+            }
+            os << "} " << static_cast<std::underlying_type_t<NodeType>>(type) << sds::DELIM << data;
+        }
         // Парсит узел из istream.
         // Возвращает пару из значения типа std::any и id родителя узла.
         static std::pair<std::any, std::optional<std::size_t>> parseNode(std::istream& is)
@@ -0,0 +1,122 @@
+// Непрерывная память для узлов дерева (используется при переразмещении дерева)
+// Автор Д. Шелемех, 2021
+
+#ifndef SDS_NODE_ARENA_HPP
+#define SDS_NODE_ARENA_HPP
+
+#include <vector>
+#include <memory>
+#include <cstddef>
+#include <utility>
+#include <functional>
+#include <algorithm>
+
+namespace sds {
+
+    // Арена с выделением "сдвигом указателя": последовательные выделения лежат в памяти подряд.
+    // Освобождение отдельных блоков не поддерживается - память арены возвращается целиком,
+    // когда удален последний выделенный в ней объект (его аллокатор владеет ареной).
+    class NodeArena
+    {
+    private:
+        std::vector<std::pair<std::unique_ptr<unsigned char[]>, std::size_t>> chunks;   // куски и их размеры
+        std::size_t chunk_size;     // размер очередного куска
+        unsigned char* cursor;      // начало свободной части текущего куска
+        std::size_t left;           // байт свободно в текущем куске
+        std::size_t used;           // байт выделено всего (с выравниванием)
+        std::size_t allocations;    // число выделений
+
+    public:
+        // Структоры
+        // Аргументы:
+        // bytes_hint - ожидаемый объем выделений (размер первого куска)
+        explicit NodeArena(std::size_t bytes_hint):
+            chunks(), chunk_size(std::max<std::size_t>(bytes_hint, 4096)), cursor(nullptr), left(0), used(0),
+            allocations(0) {}
+        NodeArena(NodeArena const& ) = delete;
+        ~NodeArena() = default;
+
+        // Присваивание
+        NodeArena& operator=(NodeArena const& ) = delete;
+
+        // Выделяет bytes байт с выравниванием alignment.
+        void* allocate(std::size_t bytes, std::size_t alignment)
+        {
+            void* pointer = cursor;
+            std::size_t space = left;
+
+            if(!cursor || !std::align(alignment, bytes, pointer, space)) {
+                std::size_t size = std::max(chunk_size, bytes + alignment);
+                chunks.emplace_back(std::unique_ptr<unsigned char[]>(new unsigned char[size]), size);
+                cursor = chunks.back().first.get();
+                pointer = cursor;
+                space = left = size;
+                std::align(alignment, bytes, pointer, space);
+            }
+
+            used += left - space + bytes;           // выравнивание и сам блок
+            ++allocations;
+            cursor = static_cast<unsigned char*>(pointer) + bytes;
+            left = space - bytes;
+            return pointer;
+        }
+
+        // Запросы
+        std::size_t bytesUsed() const noexcept {
+            return used;
+        }
+        // Средний размер выделения (с выравниванием); для арены узлов - размер узла с блоком управления.
+        std::size_t averageAllocation() const noexcept {
+            return allocations ? used / allocations : 0;
+        }
+        // Лежит ли адрес в памяти арены.
+        bool contains(void const* pointer) const noexcept
+        {
+            std::less<unsigned char const*> less;
+            unsigned char const* address = static_cast<unsigned char const*>(pointer);
+            for(auto const& chunk: chunks) {
+                if(!less(address, chunk.first.get()) && less(address, chunk.first.get() + chunk.second)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+    };
+
+    // Аллокатор для std::allocate_shared поверх NodeArena. Каждый блок управления хранит копию
+    // аллокатора, поэтому арена живет, пока жив хотя бы один узел в ней.
+    template <typename T>
+    class ArenaAllocator
+    {
+    private:
+        template <typename U>
+        friend class ArenaAllocator;
+
+        std::shared_ptr<NodeArena> arena;
+
+    public:
+        using value_type = T;
+
+        // Структоры
+        explicit ArenaAllocator(std::shared_ptr<NodeArena> arena) noexcept: arena(std::move(arena)) {}
+        template <typename U>
+        ArenaAllocator(ArenaAllocator<U> const& other) noexcept: arena(other.arena) {}
+
+        T* allocate(std::size_t count) {
+            return static_cast<T*>(arena->allocate(count * sizeof(T), alignof(T)));
+        }
+        void deallocate(T* , std::size_t ) noexcept {}
+
+        template <typename U>
+        bool operator==(ArenaAllocator<U> const& other) const noexcept {
+            return arena == other.arena;
+        }
+        template <typename U>
+        bool operator!=(ArenaAllocator<U> const& other) const noexcept {
+            return arena != other.arena;
+        }
+    };
+
+} // namespace sds
+
+#endif
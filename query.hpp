@@ -0,0 +1,413 @@
+// Запросы к дереву: построитель условий, компиляция в план выполнения, потоковая выдача результатов
+// Автор Д. Шелемех, 2021
+
+#ifndef SDS_QUERY_HPP
+#define SDS_QUERY_HPP
+
+#include "nary_tree.hpp"
+#include <vector>
+#include <deque>
+#include <string>
+#include <functional>
+#include <optional>
+#include <utility>
+#include <limits>
+#include <chrono>
+#include <sstream>
+#include <cstdint>
+#include <stdexcept>
+
+namespace sds {
+
+    // Статистика выполнения плана запроса
+    struct QueryStats {
+        std::size_t visited;        // узлов пройдено обходом
+        std::size_t tested;         // узлов, на которых проверялись условия
+        std::size_t pruned;         // поддеревьев отсечено по уровню или агрегатам
+        std::size_t matched;        // узлов выдано
+        double seconds;             // время выполнения
+    };
+
+    class QueryPlan;
+
+    // Построитель запроса. Условия объединяются по "и", несколько вызовов type / parentType - по "или".
+    // Пример: Query().under(7).type(NodeType::Double).level(3).greater(2.0).compile(tree)
+    class Query
+    {
+    private:
+        friend class QueryPlan;
+
+        std::optional<std::size_t> start_id;    // корень поддерева поиска (нет - корень дерева)
+        std::uint32_t types;                    // маска допустимых типов узла (0 - любые)
+        std::uint32_t parent_types;             // маска допустимых типов родителя (0 - любые)
+        std::size_t min_level;
+        std::size_t max_level;
+        std::optional<double> greater_than;     // числовое значение больше
+        std::optional<double> less_than;        // числовое значение меньше
+        std::optional<std::string> prefix;      // строковое значение начинается с
+        std::vector<std::function<bool(Node const&)>> predicates;   // пользовательские условия
+        std::size_t max_results;
+
+    public:
+        // Возвращает бит типа в маске (значения перечисления NodeType кратны 10).
+        static std::uint32_t typeMask(NodeType type) noexcept {
+            return std::uint32_t(1) << (static_cast<unsigned>(type) / 10);
+        }
+
+        // Структоры
+        Query(): start_id(), types(0), parent_types(0), min_level(0),
+            max_level(std::numeric_limits<std::size_t>::max()), greater_than(), less_than(), prefix(),
+            predicates(), max_results(std::numeric_limits<std::size_t>::max()) {}
+
+        // Условия
+        Query& under(std::size_t id) {
+            start_id = id;
+            return *this;
+        }
+        Query& type(NodeType type) {
+            types |= typeMask(type);
+            return *this;
+        }
+        Query& parentType(NodeType type) {
+            parent_types |= typeMask(type);
+            return *this;
+        }
+        Query& level(std::size_t level) {
+            min_level = std::max(min_level, level);
+            max_level = std::min(max_level, level);
+            return *this;
+        }
+        Query& minLevel(std::size_t level) {
+            min_level = std::max(min_level, level);
+            return *this;
+        }
+        Query& maxLevel(std::size_t level) {
+            max_level = std::min(max_level, level);
+            return *this;
+        }
+        // Значение типа Int / Long / Double больше value.
+        Query& greater(double value) {
+            greater_than = greater_than ? std::max(*greater_than, value) : value;
+            return *this;
+        }
+        // Значение типа Int / Long / Double меньше value.
+        Query& less(double value) {
+            less_than = less_than ? std::min(*less_than, value) : value;
+            return *this;
+        }
+        // Значение типа String начинается с value.
+        Query& startsWith(std::string const& value) {
+            prefix = value;
+            return *this;
+        }
+        // Произвольное условие, проверяется последним.
+        Query& where(std::function<bool(Node const&)> predicate) {
+            predicates.push_back(std::move(predicate));
+            return *this;
+        }
+        // Не более count результатов.
+        Query& limit(std::size_t count) {
+            max_results = std::min(max_results, count);
+            return *this;
+        }
+
+        // Компилирует запрос в план выполнения над деревом.
+        QueryPlan compile(NaryTree& tree) const;
+    };
+
+    // План выполнения запроса. Планировщик:
+    //  - находит корень поиска через индекс предков за O(1), если он построен;
+    //  - сужает типы по условиям на значение (числа - Int / Long / Double, префикс - String)
+    //    и распознает противоречивые условия, не обходя дерево;
+    //  - не спускается ниже максимального уровня и не проверяет условия выше минимального;
+    //  - при включенных агрегатах отсекает поддеревья, в которых нет узлов нужного уровня
+    //    или числовых значений нужного диапазона;
+    //  - проверяет условия от дешевых (тип по полю узла) к дорогим (std::any_cast, пользовательские).
+    // План остается действительным, пока не удален его корень поиска; после переразмещения дерева
+    // (relayout) корень поиска находится заново по id.
+    class QueryPlan
+    {
+    private:
+        static constexpr std::uint32_t ALL_TYPES = std::numeric_limits<std::uint32_t>::max();
+
+        NaryTree* tree;
+        Query query;                            // нормализованные условия
+        Node::PointerType start;                // корень поиска
+        std::optional<NodeType> start_parent;   // тип родителя корня поиска
+        std::string start_method;               // как найден корень поиска
+        bool empty;                             // условия противоречивы - результат пуст
+        bool prune_by_aggregates;               // есть условия, по которым агрегаты отсекают поддеревья
+        QueryStats last_stats;
+
+        // Находит корень поиска в дереве.
+        Node::PointerType findStart() const
+        {
+            Node::PointerType node = query.start_id ? tree->findNodeById(*query.start_id) : tree->getRoot();
+            if(!node) {
+                std::string msg = "Couldn't find node with ID = " + std::to_string(*query.start_id);
+                throw std::runtime_error(msg);
+            }
+            return node;
+        }
+        // Можно ли не заходить в поддерево узла: в нем заведомо нет подходящих узлов.
+        bool prunable(Node const& node) const
+        {
+            if(!prune_by_aggregates || !tree->hasAggregates()) {
+                return false;
+            }
+
+            std::size_t id = node.getId();
+            return (query.min_level && tree->aggregate(id, SubtreeAggregates::MAX_LEVEL) < double(query.min_level)) ||
+                   (query.greater_than && tree->aggregate(id, SubtreeAggregates::MAX) <= *query.greater_than) ||
+                   (query.less_than && tree->aggregate(id, SubtreeAggregates::MIN) >= *query.less_than);
+        }
+        // Проверяет условия на узле (уровень проверяется обходом).
+        bool matches(Node const& node, std::optional<NodeType> const& parent_type) const
+        {
+            if(!(query.types & Query::typeMask(node.type))) {
+                return false;
+            }
+            if(query.parent_types && (!parent_type || !(query.parent_types & Query::typeMask(*parent_type)))) {
+                return false;
+            }
+            if(query.greater_than || query.less_than) {
+                std::optional<double> value = numericValue(node);
+                if(!value || (query.greater_than && !(*value > *query.greater_than)) ||
+                   (query.less_than && !(*value < *query.less_than))) {
+                    return false;
+                }
+            }
+            if(query.prefix) {
+                std::string const* value = node.getDataIf<std::string>();
+                if(!value || value->compare(0, query.prefix->size(), *query.prefix) != 0) {
+                    return false;
+                }
+            }
+            for(std::function<bool(Node const&)> const& predicate: query.predicates) {
+                if(!predicate(node)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+        // Возвращает имена типов маски через запятую.
+        static std::string typeNames(std::uint32_t mask)
+        {
+            static const std::pair<NodeType, char const*> names[] = {
+                {NodeType::Undefined, "Undefined"}, {NodeType::Char, "Char"}, {NodeType::Int, "Int"},
+                {NodeType::Long, "Long"}, {NodeType::Double, "Double"}, {NodeType::String, "String"}
+            };
+
+            std::string result;
+            for(auto const& name: names) {
+                if(mask & Query::typeMask(name.first)) {
+                    result += (result.empty() ? "" : ", ") + std::string(name.second);
+                }
+            }
+            return result;
+        }
+
+    public:
+        // Структоры
+        QueryPlan(NaryTree& tree, Query const& query):
+            tree(&tree), query(query), start(), start_parent(), start_method(), empty(false),
+            prune_by_aggregates(false), last_stats{0, 0, 0, 0, 0}
+        {
+            // корень поиска
+            start = findStart();
+            if(!this->query.start_id) {
+                start_method = "tree root";
+            }
+            else {
+                start_method = tree.hasAncestryIndex() ? "ancestry index, O(1)" : "breadth-first search, O(n)";
+            }
+            if(this->query.parent_types && start->getParent()) {
+                start_parent = tree.findNodeById(*start->getParent())->type;
+            }
+
+            // сужение типов по условиям на значение
+            Query& q = this->query;
+            std::uint32_t numeric = Query::typeMask(NodeType::Int) | Query::typeMask(NodeType::Long) |
+                                    Query::typeMask(NodeType::Double);
+            if(!q.types) {
+                q.types = ALL_TYPES;
+            }
+            if(q.greater_than || q.less_than) {
+                q.types &= numeric;
+            }
+            if(q.prefix) {
+                q.types &= Query::typeMask(NodeType::String);
+            }
+
+            q.min_level = std::max(q.min_level, start->getLevel());
+            empty = !q.types || q.min_level > q.max_level || !q.max_results ||
+                    (q.greater_than && q.less_than && *q.greater_than >= *q.less_than);
+            prune_by_aggregates = q.min_level > start->getLevel() || q.greater_than || q.less_than;
+        }
+
+        QueryPlan(QueryPlan const& ) = default;
+        QueryPlan(QueryPlan && ) = default;
+        ~QueryPlan() = default;
+
+        // Присваивание
+        QueryPlan& operator=(QueryPlan const& ) = default;
+        QueryPlan& operator=(QueryPlan && ) = default;
+
+        // Выполняет план, передавая найденные узлы (в порядке обхода в ширину) в on_match.
+        // on_match может добавлять узлы в дерево (addChild): добавленные потомки еще не обойденных
+        // узлов тоже проверяются. Переразмещать или перезагружать дерево из on_match нельзя.
+        // Аргументы:
+        // on_match - получает узел; вернув false, останавливает выполнение
+        // Возвращает:
+        // QueryStats - статистика выполнения
+        QueryStats run(std::function<bool(Node::PointerType const&)> const& on_match)
+        {
+            std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+            QueryStats stats{0, 0, 0, 0, 0};
+            // очередь (родитель, номер среди его потомков): без лишних счетчиков ссылок и без указателей
+            // в буферы kids, которые addChild из on_match может перевыделить (nullptr - узел start)
+            std::deque<std::pair<Node const*, std::size_t>> deque;
+
+            if(start->isDetached()) {               // дерево переразмещено после компиляции плана
+                start = findStart();
+            }
+            if(!empty) {
+                if(prunable(*start)) {
+                    ++stats.pruned;
+                }
+                else {
+                    deque.emplace_back(nullptr, 0);
+                }
+            }
+
+            while(deque.size()) {
+
+                Node const* parent = deque.front().first;
+                Node::PointerType const& node_ptr = parent ? parent->kids[deque.front().second] : start;
+                std::optional<NodeType> parent_type = parent ? std::make_optional(parent->type) : start_parent;
+                deque.pop_front();
+                Node const& node = *node_ptr;
+
+                ++stats.visited;
+
+                if(node.getLevel() >= query.min_level) {
+                    ++stats.tested;
+                    if(matches(node, parent_type)) {
+                        ++stats.matched;
+                        Node::PointerType match = node_ptr;     // node_ptr лежит в буфере kids родителя
+                        if(!on_match(match) || stats.matched == query.max_results) {
+                            break;
+                        }
+                    }
+                }
+
+                if(node.getLevel() >= query.max_level) {
+                    stats.pruned += node.kids.size();
+                    continue;
+                }
+
+                for(std::size_t k = 0; k != node.kids.size(); ++k) {
+                    if(prunable(*node.kids[k])) {
+                        ++stats.pruned;
+                        continue;
+                    }
+                    deque.emplace_back(&node, k);
+                }
+            }
+
+            stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+            last_stats = stats;
+            return stats;
+        }
+        // Выполняет план и возвращает все найденные узлы.
+        std::vector<Node::PointerType> collect()
+        {
+            std::vector<Node::PointerType> result;
+            run([&result](Node::PointerType const& node) {
+                result.push_back(node);
+                return true;
+            });
+            return result;
+        }
+
+        // Запросы
+        // Статистика последнего выполнения.
+        QueryStats const& stats() const noexcept {
+            return last_stats;
+        }
+        // Возвращает текстовое описание плана.
+        std::string explain() const
+        {
+            std::ostringstream os;
+
+            os << "start:    node " << start->getId() << " (" << start_method << ")\n";
+
+            if(empty) {
+                os << "result:   empty (contradictory conditions), tree is not traversed\n";
+                return os.str();
+            }
+
+            os << "traverse: breadth-first, test levels >= " << query.min_level;
+            if(query.max_level != std::numeric_limits<std::size_t>::max()) {
+                os << ", don't descend below level " << query.max_level;
+            }
+            os << "\n";
+
+            os << "prune:    ";
+            if(prune_by_aggregates && tree->hasAggregates()) {
+                os << "subtree aggregates (";
+                std::string sep;
+                if(query.min_level > start->getLevel()) {
+                    os << "max level < " << query.min_level;
+                    sep = ", ";
+                }
+                if(query.greater_than) {
+                    os << sep << "max value <= " << *query.greater_than;
+                    sep = ", ";
+                }
+                if(query.less_than) {
+                    os << sep << "min value >= " << *query.less_than;
+                }
+                os << ")\n";
+            }
+            else {
+                os << (prune_by_aggregates ? "none (enable aggregates to prune subtrees)\n" : "none\n");
+            }
+
+            os << "filter:   ";
+            if(query.types != ALL_TYPES) {
+                os << "type in {" << typeNames(query.types) << "}; ";
+            }
+            if(query.parent_types) {
+                os << "parent type in {" << typeNames(query.parent_types) << "}; ";
+            }
+            if(query.greater_than) {
+                os << "value > " << *query.greater_than << "; ";
+            }
+            if(query.less_than) {
+                os << "value < " << *query.less_than << "; ";
+            }
+            if(query.prefix) {
+                os << "prefix \"" << *query.prefix << "\"; ";
+            }
+            if(query.predicates.size()) {
+                os << query.predicates.size() << " custom predicate(s); ";
+            }
+            os << "\n";
+
+            if(query.max_results != std::numeric_limits<std::size_t>::max()) {
+                os << "limit:    " << query.max_results << "\n";
+            }
+
+            return os.str();
+        }
+    };
+
+    inline QueryPlan Query::compile(NaryTree& tree) const
+    {
+        return QueryPlan(tree, *this);
+    }
+
+} // namespace sds
+
+#endif
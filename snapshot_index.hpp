@@ -0,0 +1,185 @@
+// Индекс снимка дерева (sidecar-файл к сериализованному дереву)
+// Автор Д. Шелемех, 2021
+
+#ifndef SDS_SNAPSHOT_INDEX_HPP
+#define SDS_SNAPSHOT_INDEX_HPP
+
+#include "exceptions.hpp"
+#include "constants.hpp"
+#include <vector>
+#include <string>
+#include <istream>
+#include <ostream>
+#include <sstream>
+#include <utility>
+#include <stdexcept>
+
+namespace sds {
+
+    // Индекс снимка дерева.
+    // Снимок пишется в порядке обхода в ширину, поэтому потомки любой записи лежат в файле подряд,
+    // а потомки любого непрерывного диапазона записей - тоже непрерывный диапазон.
+    // Номер записи в снимке совпадает с id узла после загрузки.
+    class SnapshotIndex
+    {
+    public:
+        // Элемент индекса (одна запись снимка)
+        struct Entry {
+            std::size_t offset;         // смещение записи от начала потока
+            std::size_t first_kid;      // номер записи первого потомка (или место, где он был бы)
+            std::size_t kids_count;     // количество потомков
+        };
+
+    private:
+        std::vector<Entry> entries;
+        std::size_t snapshot_size;      // размер снимка в байтах (для проверки, что индекс от него)
+
+    public:
+        // Структоры
+        SnapshotIndex(): entries(), snapshot_size(0) {}
+        SnapshotIndex(std::vector<Entry> && entries, std::size_t snapshot_size):
+            entries(std::move(entries)), snapshot_size(snapshot_size) {}
+
+        // Запросы
+        std::size_t size() const noexcept {
+            return entries.size();
+        }
+        std::size_t snapshotSize() const noexcept {
+            return snapshot_size;
+        }
+        Entry const& operator[](std::size_t record) const {
+            return entries.at(record);
+        }
+        // Возвращает диапазон записей [first, last) потомков диапазона записей [first, last).
+        std::pair<std::size_t, std::size_t> kidsRange(std::size_t first, std::size_t last) const
+        {
+            if(first == last) {
+                return std::make_pair(first, last);
+            }
+
+            Entry const& back = entries.at(last - 1);
+            return std::make_pair(entries.at(first).first_kid, back.first_kid + back.kids_count);
+        }
+
+        // IO
+
+        // Строит индекс, просматривая снимок дерева (значения узлов не разбираются).
+        // Аргументы:
+        // is - поток со снимком дерева, позиционированный на его начало
+        static SnapshotIndex build(std::istream& is)
+        {
+            std::vector<Entry> entries;
+            std::string line;
+            std::size_t offset = 0, last_parent = 0;
+
+            if(!std::getline(is, line, EOL) || line.compare(0, std::string(MAGIC_TAG).size(), MAGIC_TAG) != 0) {
+                throw DeserialisationException("Wrong input file format");
+            }
+            offset += line.size() + !is.eof();      // у последней строки нет EOL
+
+            while(std::getline(is, line, EOL))
+            {
+                std::size_t record = entries.size(), close = line.find('}');
+
+                if(line.empty() || line[0] != '{' || close == std::string::npos) {
+                    throw DeserialisationException("Malformed record #" + std::to_string(record));
+                }
+
+                std::string parent = line.substr(1, close - 1);
+
+                entries.push_back(Entry{offset, 0, 0});
+                offset += line.size() + !is.eof();
+
+                if(parent == ROOT_STR) {
+                    if(record != 0) {
+                        throw DeserialisationException("Root must be the first record");
+                    }
+                    continue;
+                }
+
+                std::size_t parent_record = 0;
+                if(!(std::istringstream(parent) >> parent_record)) {
+                    throw DeserialisationException("Malformed record #" + std::to_string(record));
+                }
+
+                // снимок должен быть записан в порядке обхода в ширину
+                if(record == 0 || parent_record >= record || parent_record < last_parent) {
+                    throw DeserialisationException("Snapshot isn't in breadth-first order at record #" +
+                                                   std::to_string(record));
+                }
+                last_parent = parent_record;
+                ++entries[parent_record].kids_count;
+            }
+
+            // потомки идут подряд в порядке родителей, начиная с записи 1
+            std::size_t next = 1;
+            for(Entry& entry: entries) {
+                entry.first_kid = next;
+                next += entry.kids_count;
+            }
+
+            return SnapshotIndex(std::move(entries), offset);
+        }
+        // Сериализует индекс.
+        // Аргументы:
+        // os - поток для вывода
+        void save(std::ostream& os) const
+        {
+            os << INDEX_MAGIC_TAG << DELIM << INDEX_VERSION << EOL;
+            os << entries.size() << DELIM << snapshot_size << EOL;
+            for(Entry const& entry: entries) {
+                os << entry.offset << DELIM << entry.first_kid << DELIM << entry.kids_count << EOL;
+            }
+        }
+        // Загружает индекс из потока.
+        // Аргументы:
+        // is - поток для ввода
+        static SnapshotIndex load(std::istream& is)
+        {
+            std::string line;
+            std::string header = std::string(INDEX_MAGIC_TAG) + DELIM + std::to_string(INDEX_VERSION);
+
+            if(!std::getline(is, line, EOL) || line != header) {
+                throw DeserialisationException("Wrong index file format");
+            }
+
+            std::size_t count = 0, snapshot_size = 0;
+            char delim;
+            if(!std::getline(is, line, EOL) || !(std::istringstream(line) >> count >> delim >> snapshot_size) ||
+               delim != DELIM) {
+                throw DeserialisationException("Wrong index file format");
+            }
+
+            std::vector<Entry> entries;
+            entries.reserve(count);
+
+            char delim1, delim2;
+            Entry entry{0, 0, 0};
+            std::size_t next = 1;               // где должны начинаться потомки записи (порядок обхода в ширину)
+
+            for(std::size_t i = 0; i != count; ++i) {
+                if(!std::getline(is, line, EOL)) {
+                    throw DeserialisationException("Index file is truncated");
+                }
+                std::istringstream iss(line);
+                if(!(iss >> entry.offset >> delim1 >> entry.first_kid >> delim2 >> entry.kids_count) ||
+                   delim1 != DELIM || delim2 != DELIM || entry.offset >= snapshot_size ||
+                   (i && entry.offset <= entries.back().offset) ||
+                   entry.first_kid != next || entry.kids_count > count - next) {
+                    throw DeserialisationException("Malformed index entry #" + std::to_string(i));
+                }
+                next += entry.kids_count;
+                entries.push_back(entry);
+            }
+            if(count && next != count) {
+                throw DeserialisationException("Index doesn't describe a tree: " + std::to_string(next) +
+                                               " records are referenced, " + std::to_string(count) + " are present");
+            }
+
+            return SnapshotIndex(std::move(entries), snapshot_size);
+        }
+    };
+
+} // namespace sds
+
+#endif
@@ -0,0 +1,304 @@
+// Агрегаты поддеревьев (размер, глубина, сумма / минимум / максимум), поддерживаемые инкрементально
+// Автор Д. Шелемех, 2021
+
+#ifndef SDS_SUBTREE_AGGREGATES_HPP
+#define SDS_SUBTREE_AGGREGATES_HPP
+
+#include "node.hpp"
+#include <vector>
+#include <string>
+#include <functional>
+#include <optional>
+#include <limits>
+#include <algorithm>
+#include <stdexcept>
+#include <cstdint>
+
+namespace sds {
+
+    // Возвращает числовое значение узла типов Int / Long / Double.
+    inline std::optional<double> numericValue(Node const& node) noexcept
+    {
+        if(int const* value = node.getDataIf<int>()) {
+            return static_cast<double>(*value);
+        }
+        if(long const* value = node.getDataIf<long>()) {
+            return static_cast<double>(*value);
+        }
+        if(double const* value = node.getDataIf<double>()) {
+            return *value;
+        }
+        return std::nullopt;
+    }
+    // Возвращает значение узла типов Int / Long как целое (для точных сумм).
+    inline std::optional<long long> integerValue(Node const& node) noexcept
+    {
+        if(int const* value = node.getDataIf<int>()) {
+            return *value;
+        }
+        if(long const* value = node.getDataIf<long>()) {
+            return *value;
+        }
+        return std::nullopt;
+    }
+
+    // Агрегат в виде моноида: значение поддерева = combine(lift(узел), значения поддеревьев потомков).
+    // combine должна быть ассоциативной и коммутативной, identity - ее нейтральный элемент.
+    struct Aggregator {
+        std::string name;                                   // имя агрегата
+        double identity;                                    // нейтральный элемент
+        std::function<double(Node const&)> lift;            // вклад одного узла
+        std::function<double(double, double)> combine;      // операция моноида
+    };
+
+    // Агрегаты всех поддеревьев, таблицы индексируются id узла.
+    // Добавление листа обновляет агрегаты его предков за O(h), запрос - O(1).
+    class SubtreeAggregates
+    {
+    public:
+        // Встроенные агрегаты (номера, под которыми они зарегистрированы)
+        static constexpr std::size_t COUNT      = 0;    // число узлов поддерева
+        static constexpr std::size_t MAX_LEVEL  = 1;    // наибольший уровень в поддереве
+        static constexpr std::size_t SUM        = 2;    // сумма числовых значений
+        static constexpr std::size_t MIN        = 3;    // минимум числовых значений
+        static constexpr std::size_t MAX        = 4;    // максимум числовых значений
+
+    private:
+        static constexpr std::size_t NONE = static_cast<std::size_t>(-1);
+
+        Node::PointerType root;
+        std::vector<Aggregator> aggregators;
+        std::vector<std::vector<double>> values;    // values[агрегат][id]
+        std::vector<std::uint64_t> integer_sums;    // точные суммы Int / Long по id (по модулю 2^64)
+        std::vector<std::size_t> parents;           // id родителя по id (NONE - корень / нет узла)
+        std::vector<Node const*> nodes;             // узлы по id (для проверки принадлежности дереву)
+
+        // Возвращает встроенные агрегаты.
+        static std::vector<Aggregator> builtins()
+        {
+            const double inf = std::numeric_limits<double>::infinity();
+            auto sum = [](double a, double b) { return a + b; };
+            auto min = [](double a, double b) { return std::min(a, b); };
+            auto max = [](double a, double b) { return std::max(a, b); };
+
+            return {
+                {"count", 0, [](Node const& ) { return 1.0; }, sum},
+                {"max_level", 0, [](Node const& node) { return static_cast<double>(node.getLevel()); }, max},
+                {"sum", 0, [](Node const& node) { return numericValue(node).value_or(0); }, sum},
+                {"min", inf, [inf](Node const& node) { return numericValue(node).value_or(inf); }, min},
+                {"max", -inf, [inf](Node const& node) { return numericValue(node).value_or(-inf); }, max}
+            };
+        }
+        // Расширяет таблицы до id.
+        void reserveId(std::size_t id)
+        {
+            if(id >= parents.size()) {
+                parents.resize(id + 1, NONE);
+                nodes.resize(id + 1, nullptr);
+                integer_sums.resize(id + 1, 0);
+                for(std::size_t k = 0; k != values.size(); ++k) {
+                    values[k].resize(id + 1, aggregators[k].identity);
+                }
+            }
+        }
+        // Вычисляет агрегат k для всех поддеревьев за O(n).
+        // Аргументы:
+        // k - номер агрегата
+        // order - узлы дерева в порядке обхода в ширину
+        void compute(std::size_t k, std::vector<Node*> const& order)
+        {
+            Aggregator const& aggregator = aggregators[k];
+            std::vector<double>& value = values[k];
+
+            for(Node* node: order) {
+                value[node->getId()] = aggregator.lift(*node);
+            }
+            for(std::size_t i = order.size(); i-- > 1; ) {
+                std::size_t id = order[i]->getId();
+                value[parents[id]] = aggregator.combine(value[parents[id]], value[id]);
+            }
+        }
+        // Вклад узла в точную сумму.
+        static std::uint64_t liftInteger(Node const& node) noexcept {
+            return static_cast<std::uint64_t>(integerValue(node).value_or(0));
+        }
+        // Вызывает visit для каждого узла поддерева top (обход в глубину).
+        template <typename Visit>
+        static void walkNodes(Node const& top, Visit visit)
+        {
+            std::vector<Node const*> stack(1, &top);
+            while(!stack.empty()) {
+                Node const* node = stack.back();
+                stack.pop_back();
+                visit(*node);
+                for(Node::PointerType const& kid: node->kids) {
+                    stack.push_back(kid.get());
+                }
+            }
+        }
+        // Возвращает узлы дерева в порядке обхода в ширину.
+        std::vector<Node*> breadthFirstOrder() const
+        {
+            std::vector<Node*> order(1, root.get());
+            for(std::size_t i = 0; i != order.size(); ++i) {
+                for(Node::PointerType const& kid: order[i]->kids) {
+                    order.push_back(kid.get());
+                }
+            }
+            return order;
+        }
+        // Проверяет наличие узла.
+        void check(std::size_t id) const
+        {
+            if(id >= parents.size() || (parents[id] == NONE && id != root->getId())) {
+                std::string msg = "Couldn't find node with ID = " + std::to_string(id);
+                throw std::runtime_error(msg);
+            }
+        }
+
+    public:
+        // Структоры
+        explicit SubtreeAggregates(Node::PointerType const& root):
+            root(), aggregators(builtins()), values(aggregators.size()), integer_sums(), parents(), nodes()
+        {
+            rebuild(root);
+        }
+
+        // Возвращает встроенный агрегат k (COUNT ... MAX).
+        static Aggregator builtin(std::size_t k) {
+            return builtins().at(k);
+        }
+        // Вычисляет агрегат для поддерева top обходом, без таблиц: O(размер поддерева).
+        static double walk(Node const& top, Aggregator const& aggregator)
+        {
+            double value = aggregator.identity;
+            walkNodes(top, [&](Node const& node) { value = aggregator.combine(value, aggregator.lift(node)); });
+            return value;
+        }
+        // Вычисляет точную сумму значений Int / Long поддерева top обходом.
+        static long long walkIntegerSum(Node const& top)
+        {
+            std::uint64_t sum = 0;
+            walkNodes(top, [&sum](Node const& node) { sum += liftInteger(node); });
+            return static_cast<long long>(sum);
+        }
+
+        // Модификаторы
+
+        // Регистрирует агрегат и вычисляет его для всего дерева.
+        // Возвращает:
+        // std::size_t - номер агрегата для запросов
+        std::size_t add(Aggregator const& aggregator)
+        {
+            aggregators.push_back(aggregator);
+            values.emplace_back(parents.size(), aggregator.identity);
+            compute(aggregators.size() - 1, breadthFirstOrder());
+            return aggregators.size() - 1;
+        }
+        // Пересчитывает все агрегаты для (нового) дерева.
+        void rebuild(Node::PointerType const& new_root)
+        {
+            root = new_root;
+            parents.clear();
+            nodes.clear();
+            integer_sums.clear();
+            for(std::vector<double>& value: values) {
+                value.clear();
+            }
+
+            std::vector<Node*> order = breadthFirstOrder();
+            for(Node* node: order) {
+                reserveId(node->getId());
+                nodes[node->getId()] = node;
+                for(Node::PointerType const& kid: node->kids) {
+                    reserveId(kid->getId());
+                    parents[kid->getId()] = node->getId();
+                }
+            }
+
+            for(std::size_t k = 0; k != aggregators.size(); ++k) {
+                compute(k, order);
+            }
+            for(Node* node: order) {
+                integer_sums[node->getId()] = liftInteger(*node);
+            }
+            for(std::size_t i = order.size(); i-- > 1; ) {
+                std::size_t id = order[i]->getId();
+                integer_sums[parents[id]] += integer_sums[id];
+            }
+        }
+        // Учитывает новый лист: обновляет агрегаты всех его предков.
+        void addLeaf(Node::PointerType const& node)
+        {
+            std::size_t id = node->getId();
+
+            reserveId(id);
+            parents[id] = *node->getParent();
+            nodes[id] = node.get();
+
+            for(std::size_t k = 0; k != aggregators.size(); ++k) {
+                Aggregator const& aggregator = aggregators[k];
+                std::vector<double>& value = values[k];
+                double lifted = aggregator.lift(*node);
+
+                value[id] = lifted;
+                for(std::size_t p = parents[id]; p != NONE; p = parents[p]) {
+                    value[p] = aggregator.combine(value[p], lifted);
+                }
+            }
+
+            integer_sums[id] = liftInteger(*node);
+            for(std::size_t p = parents[id]; p != NONE; p = parents[p]) {
+                integer_sums[p] += integer_sums[id];
+            }
+        }
+
+        // Запросы
+        std::size_t size() const noexcept {
+            return aggregators.size();
+        }
+        Aggregator const& getAggregator(std::size_t k) const {
+            return aggregators.at(k);
+        }
+        // Возвращает число байт, занятых таблицами агрегатов.
+        std::size_t memoryUsage() const noexcept
+        {
+            std::size_t bytes = parents.capacity() * sizeof(std::size_t) + nodes.capacity() * sizeof(Node const*) +
+                                integer_sums.capacity() * sizeof(std::uint64_t);
+            for(std::vector<double> const& value: values) {
+                bytes += value.capacity() * sizeof(double);
+            }
+            return bytes;
+        }
+        // Принадлежит ли узел дереву, для которого построены агрегаты.
+        bool contains(Node const* node) const noexcept {
+            return node->getId() < nodes.size() && nodes[node->getId()] == node;
+        }
+        // Возвращает номер агрегата по имени.
+        std::optional<std::size_t> find(std::string const& name) const
+        {
+            for(std::size_t k = 0; k != aggregators.size(); ++k) {
+                if(aggregators[k].name == name) {
+                    return k;
+                }
+            }
+            return std::nullopt;
+        }
+        // Возвращает значение агрегата k для поддерева узла id.
+        double get(std::size_t id, std::size_t k) const
+        {
+            check(id);
+            return values.at(k)[id];
+        }
+        // Возвращает точную сумму значений Int / Long поддерева узла id
+        // (при выходе за пределы long long - по модулю 2^64).
+        long long integerSum(std::size_t id) const
+        {
+            check(id);
+            return static_cast<long long>(integer_sums[id]);
+        }
+    };
+
+} // namespace sds
+
+#endif
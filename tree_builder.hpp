@@ -0,0 +1,165 @@
+// Пакетное построение дерева
+// Автор Д. Шелемех, 2021
+
+#ifndef SDS_TREE_BUILDER_HPP
+#define SDS_TREE_BUILDER_HPP
+
+#include "node.hpp"
+#include "exceptions.hpp"
+#include <vector>
+#include <any>
+#include <optional>
+#include <utility>
+#include <string>
+
+namespace sds {
+
+    // Строит дерево за линейное время из набора (значение, id родителя), где id узла - его номер
+    // в наборе. Сначала считаются потомки, затем под них резервируется точная емкость kids,
+    // значения перемещаются в узлы, а уровни вычисляются одним обходом в ширину от корня.
+    // Порядок узлов произвольный: родитель может идти после потомка.
+    class TreeBuilder
+    {
+    private:
+        std::vector<std::any> values;                       // значения узлов
+        std::vector<std::optional<std::size_t>> parents;    // id родителей (std::nullopt - корень)
+
+    public:
+        // Структоры
+        TreeBuilder(): values(), parents() {}
+        // Параллельные массивы id родителей и значений.
+        TreeBuilder(std::vector<std::optional<std::size_t>> && parents, std::vector<std::any> && values):
+            values(std::move(values)), parents(std::move(parents))
+        {
+            if(this->values.size() != this->parents.size()) {
+                throw BadTreeStructure("Arrays of parents and values differ in size");
+            }
+        }
+        // Диапазон пар (значение, id родителя), как их возвращает Node::parseNode.
+        template <typename InputIt>
+        TreeBuilder(InputIt first, InputIt last): values(), parents()
+        {
+            for(; first != last; ++first) {
+                add(*first);
+            }
+        }
+
+        // Модификаторы
+        void reserve(std::size_t count)
+        {
+            values.reserve(count);
+            parents.reserve(count);
+        }
+        // Добавляет узел.
+        // Аргументы:
+        // data - значение узла
+        // parent - id родителя (std::nullopt для корня)
+        // Возвращает:
+        // std::size_t - id, который получит узел
+        std::size_t add(std::any && data, std::optional<std::size_t> const& parent)
+        {
+            values.push_back(std::move(data));
+            parents.push_back(parent);
+            return values.size() - 1;
+        }
+        std::size_t add(std::any const& data, std::optional<std::size_t> const& parent)
+        {
+            values.push_back(data);
+            parents.push_back(parent);
+            return values.size() - 1;
+        }
+        std::size_t add(std::pair<std::any, std::optional<std::size_t>> && node)
+        {
+            return add(std::move(node.first), node.second);
+        }
+        std::size_t add(std::pair<std::any, std::optional<std::size_t>> const& node)
+        {
+            return add(node.first, node.second);
+        }
+
+        // Запросы
+        std::size_t size() const noexcept {
+            return values.size();
+        }
+
+        // Строит дерево, забирая значения из построителя (после вызова построитель пуст).
+        // id узлов - 0 .. size() - 1.
+        // Возвращает:
+        // Node::PointerType - корень построенного дерева
+        Node::PointerType build()
+        {
+            std::size_t count = values.size();
+            std::optional<std::size_t> root;
+            std::vector<std::size_t> kids_count(count, 0);
+
+            if(!count) {
+                throw BadTreeStructure("Can't build a tree without nodes");
+            }
+
+            // проверка связей и подсчет потомков
+            for(std::size_t i = 0; i != count; ++i) {
+                if(!parents[i]) {
+                    if(root) {
+                        throw BadTreeStructure("More than one root: nodes " + std::to_string(*root) +
+                                               " and " + std::to_string(i));
+                    }
+                    root = i;
+                }
+                else if(*parents[i] >= count) {
+                    throw BadTreeStructure("Couldn't find parent with ID = " + std::to_string(*parents[i]) +
+                                           " of node " + std::to_string(i));
+                }
+                else if(*parents[i] == i) {
+                    throw BadTreeStructure("Node " + std::to_string(i) + " is its own parent");
+                }
+                else {
+                    ++kids_count[*parents[i]];
+                }
+            }
+
+            if(!root) {
+                throw BadTreeStructure("Tree has no root (parent links form a cycle)");
+            }
+
+            // узлы с точной емкостью kids
+            std::vector<Node::PointerType> nodes(count);
+            for(std::size_t i = 0; i != count; ++i) {
+                nodes[i] = std::make_shared<Node>(std::move(values[i]), std::move(parents[i]), 0);
+                nodes[i]->id = Node::toId(i);
+                nodes[i]->kids.reserve(kids_count[i]);
+            }
+            for(std::size_t i = 0; i != count; ++i) {
+                if(i != *root) {
+                    nodes[nodes[i]->parent]->kids.push_back(nodes[i]);
+                }
+            }
+
+            // уровни - обходом в ширину; недостижимые из корня узлы лежат на цикле
+            std::vector<Node*> order;
+            order.reserve(count);
+            order.push_back(nodes[*root].get());
+            for(std::size_t i = 0; i != order.size(); ++i) {
+                for(Node::PointerType const& kid: order[i]->kids) {
+                    kid->level = Node::toLevel(order[i]->getLevel() + 1);
+                    order.push_back(kid.get());
+                }
+            }
+
+            if(order.size() != count) {
+                for(Node::PointerType const& node: nodes) {    // разрываем циклы владения
+                    node->kids.clear();
+                }
+                throw BadTreeStructure("Parent links form a cycle: " + std::to_string(count - order.size()) +
+                                       " node(s) unreachable from the root");
+            }
+
+            values.clear();
+            parents.clear();
+
+            return nodes[*root];
+        }
+    };
+
+} // namespace sds
+
+#endif
@@ -0,0 +1,477 @@
+// Образ дерева только для чтения: смещения вместо указателей, разделяемое отображение в память
+// Автор Д. Шелемех, 2021
+
+#ifndef SDS_TREE_IMAGE_HPP
+#define SDS_TREE_IMAGE_HPP
+
+#include "nary_tree.hpp"
+#include "exceptions.hpp"
+#include "constants.hpp"
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <optional>
+#include <algorithm>
+#include <limits>
+#include <type_traits>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace sds {
+
+    // Заголовок образа. Все смещения отсчитываются от начала образа, числа - в порядке байт машины.
+    struct ImageHeader {
+        char magic[8];                  // IMAGE_MAGIC_TAG
+        std::uint32_t version;          // IMAGE_VERSION
+        std::uint32_t reserved;
+        std::uint64_t node_count;
+        std::uint64_t nodes_offset;     // таблица ImageNode
+        std::uint64_t ids_offset;       // таблица ImageId, отсортированная по id (0 - id совпадают с номерами узлов)
+        std::uint64_t pool_offset;      // пул строк
+        std::uint64_t pool_size;
+        std::uint64_t image_size;
+    };
+    // Узел образа. Узлы лежат в порядке обхода в ширину, поэтому потомки узла идут подряд.
+    struct ImageNode {
+        std::uint64_t id;
+        std::uint64_t parent;           // номер родителя (IMAGE_NO_PARENT у корня)
+        std::uint64_t first_kid;        // номер первого потомка
+        std::uint64_t payload;          // Char / Int / Long - значение, Double - его биты, String - смещение в пуле
+        std::uint32_t kids_count;
+        std::uint32_t length;           // длина строки
+        std::uint32_t level;
+        std::uint8_t type;              // NodeType
+        std::uint8_t reserved[3];
+    };
+    // Элемент таблицы id (для деревьев, у которых id не совпадают с номерами узлов)
+    struct ImageId {
+        std::uint64_t id;
+        std::uint64_t index;
+    };
+
+    static_assert(std::is_trivially_copyable_v<ImageNode> && sizeof(ImageNode) == 48, "Unexpected image layout");
+
+    // Образ дерева, отображенный в память только для чтения. Вместо std::shared_ptr и std::any
+    // узлы ссылаются друг на друга номерами, а строки - смещениями в пуле, поэтому один физический
+    // экземпляр образа (файл в page cache или объект POSIX shared memory) разделяют все процессы,
+    // а подключение к нему - это mmap вместо разбора файла.
+    // Писатель публикует новый образ атомарно: запись во временный файл и rename. Подключенные
+    // читатели продолжают видеть старый образ, пока не переподключатся.
+    class TreeImage
+    {
+    public:
+        static constexpr std::uint64_t IMAGE_NO_PARENT = std::numeric_limits<std::uint64_t>::max();
+
+        // Узел образа (легкий дескриптор). Ссылается только на память отображения, поэтому остается
+        // действительным при перемещении объекта TreeImage - пока отображение не закрыто.
+        class NodeView
+        {
+        private:
+            ImageHeader const* header;      // начало отображения
+            ImageNode const* node;
+
+        public:
+            // Структоры
+            NodeView(ImageHeader const* header, ImageNode const* node) noexcept: header(header), node(node) {}
+            NodeView(NodeView const& ) = default;
+            ~NodeView() = default;
+
+            // Присваивание
+            NodeView& operator=(NodeView const& ) = default;
+
+            // Запросы
+            std::size_t getId() const noexcept {
+                return node->id;
+            }
+            std::optional<std::size_t> getParent() const
+            {
+                if(node->parent == IMAGE_NO_PARENT) {
+                    return std::nullopt;
+                }
+                return nodeAt(header, node->parent).getId();
+            }
+            std::size_t getLevel() const noexcept {
+                return node->level;
+            }
+            NodeType getNodeType() const noexcept {
+                return static_cast<NodeType>(node->type);
+            }
+            bool isEmpty() const noexcept {
+                return getNodeType() == NodeType::Undefined;
+            }
+            std::size_t kidsCount() const noexcept {
+                return node->kids_count;
+            }
+            // Возвращает i-го потомка.
+            NodeView kid(std::size_t i) const
+            {
+                if(i >= node->kids_count) {
+                    throw std::out_of_range("Node " + std::to_string(node->id) + " has no kid #" + std::to_string(i));
+                }
+                return nodeAt(header, node->first_kid + i);
+            }
+            // Возвращает значение узла, если оно типа T (char, int, long, double или
+            // std::string_view - строка в образе без копирования), иначе std::nullopt.
+            template <typename T>
+            std::optional<T> getValue() const
+            {
+                NodeType type = getNodeType();
+
+                if constexpr(std::is_same_v<T, std::string_view>) {
+                    if(type != NodeType::String) {
+                        return std::nullopt;
+                    }
+                    return poolString(header, node->payload, node->length);
+                }
+                else if constexpr(std::is_same_v<T, double>) {
+                    if(type != NodeType::Double) {
+                        return std::nullopt;
+                    }
+                    double value;
+                    std::memcpy(&value, &node->payload, sizeof(value));
+                    return value;
+                }
+                else {
+                    static_assert(std::is_same_v<T, char> || std::is_same_v<T, int> || std::is_same_v<T, long>,
+                                  "Unsupported node value type");
+                    if((std::is_same_v<T, char> && type != NodeType::Char) ||
+                       (std::is_same_v<T, int> && type != NodeType::Int) ||
+                       (std::is_same_v<T, long> && type != NodeType::Long)) {
+                        return std::nullopt;
+                    }
+                    return static_cast<T>(static_cast<std::int64_t>(node->payload));
+                }
+            }
+        };
+
+    private:
+        void* base;                     // начало отображения
+        std::size_t bytes;              // размер отображения
+        ImageHeader const* header;
+        ImageNode const* nodes;
+        ImageId const* ids;             // nullptr - id совпадают с номерами узлов
+        char const* pool;
+
+        // Проверяет, что [offset, offset + count * size) лежит внутри образа.
+        static bool fits(std::uint64_t offset, std::uint64_t count, std::uint64_t size, std::size_t bytes) noexcept
+        {
+            return offset <= bytes && offset % 8 == 0 && count <= (bytes - offset) / size;
+        }
+        // Проверяет заголовок и границы таблиц (узлы проверяются при обращении к ним).
+        void validate() const
+        {
+            if(bytes < sizeof(ImageHeader) ||
+               std::strncmp(header->magic, IMAGE_MAGIC_TAG, sizeof(header->magic)) != 0) {
+                throw DeserialisationException("Wrong tree image format");
+            }
+            if(header->version != IMAGE_VERSION) {
+                throw DeserialisationException("Unsupported tree image version " + std::to_string(header->version));
+            }
+            if(header->image_size != bytes || !header->node_count ||
+               !fits(header->nodes_offset, header->node_count, sizeof(ImageNode), bytes) ||
+               (header->ids_offset && !fits(header->ids_offset, header->node_count, sizeof(ImageId), bytes)) ||
+               !fits(header->pool_offset, header->pool_size, 1, bytes)) {
+                throw DeserialisationException("Corrupted tree image: tables exceed the image size");
+            }
+        }
+        // Возвращает узел образа по номеру.
+        static NodeView nodeAt(ImageHeader const* header, std::uint64_t index)
+        {
+            if(index >= header->node_count) {
+                throw DeserialisationException("Corrupted tree image: node #" + std::to_string(index) +
+                                               " is out of range");
+            }
+            char const* begin = reinterpret_cast<char const*>(header);
+            return NodeView(header, reinterpret_cast<ImageNode const*>(begin + header->nodes_offset) + index);
+        }
+        // Возвращает строку из пула образа.
+        static std::string_view poolString(ImageHeader const* header, std::uint64_t offset, std::uint64_t length)
+        {
+            if(offset > header->pool_size || length > header->pool_size - offset) {
+                throw DeserialisationException("Corrupted tree image: string exceeds the pool");
+            }
+            return std::string_view(reinterpret_cast<char const*>(header) + header->pool_offset + offset, length);
+        }
+        // Отображает открытый дескриптор в память (дескриптор закрывается).
+        static TreeImage map(int fd, std::string const& name)
+        {
+            struct stat info;
+            void* base = MAP_FAILED;
+
+            if(::fstat(fd, &info) == 0 && info.st_size > 0) {
+                base = ::mmap(nullptr, static_cast<std::size_t>(info.st_size), PROT_READ, MAP_SHARED, fd, 0);
+            }
+            ::close(fd);
+
+            if(base == MAP_FAILED) {
+                std::string msg = "Can't map tree image '" + name + "'";
+                throw std::runtime_error(msg);
+            }
+
+            return TreeImage(base, static_cast<std::size_t>(info.st_size));
+        }
+        // Проверяет, что значение помещается в 32-битное поле образа.
+        static std::uint32_t toField(std::size_t value, char const* what)
+        {
+            if(value > std::numeric_limits<std::uint32_t>::max()) {
+                throw std::overflow_error(std::string(what) + " " + std::to_string(value) + " doesn't fit the tree image");
+            }
+            return static_cast<std::uint32_t>(value);
+        }
+
+        // Структоры
+        TreeImage(void* base, std::size_t bytes):
+            base(base), bytes(bytes), header(static_cast<ImageHeader const*>(base)), nodes(nullptr), ids(nullptr),
+            pool(nullptr)
+        {
+            try {
+                validate();
+            }
+            catch(...) {
+                ::munmap(base, bytes);
+                throw;
+            }
+
+            char const* begin = static_cast<char const*>(base);
+            nodes = reinterpret_cast<ImageNode const*>(begin + header->nodes_offset);
+            ids = header->ids_offset ? reinterpret_cast<ImageId const*>(begin + header->ids_offset) : nullptr;
+            pool = begin + header->pool_offset;
+        }
+
+    public:
+        TreeImage(TreeImage const& ) = delete;
+        TreeImage(TreeImage && other) noexcept:
+            base(other.base), bytes(other.bytes), header(other.header), nodes(other.nodes), ids(other.ids),
+            pool(other.pool)
+        {
+            other.base = nullptr;
+        }
+        ~TreeImage()
+        {
+            if(base) {
+                ::munmap(base, bytes);
+            }
+        }
+
+        // Присваивание
+        TreeImage& operator=(TreeImage const& ) = delete;
+        TreeImage& operator=(TreeImage && other) noexcept
+        {
+            if(this != &other) {
+                if(base) {
+                    ::munmap(base, bytes);
+                }
+                base = other.base;
+                bytes = other.bytes;
+                header = other.header;
+                nodes = other.nodes;
+                ids = other.ids;
+                pool = other.pool;
+                other.base = nullptr;
+            }
+            return *this;
+        }
+
+        // Построение и публикация
+
+        // Строит образ дерева в памяти.
+        // Возвращает:
+        // std::vector<char> - байты образа
+        static std::vector<char> build(NaryTree& tree)
+        {
+            std::vector<Node::PointerType> order = tree.getNodesVector();
+            std::vector<ImageNode> image_nodes(order.size(), ImageNode{0, IMAGE_NO_PARENT, 0, 0, 0, 0, 0, 0, {0, 0, 0}});
+            std::vector<ImageId> image_ids;
+            std::string strings;
+            bool dense = true;
+
+            for(std::size_t i = 0, next_kid = 1; i != order.size(); ++i) {
+                Node const& node = *order[i];
+                ImageNode& image_node = image_nodes[i];
+
+                image_node.id = node.getId();
+                image_node.first_kid = next_kid;
+                image_node.kids_count = toField(node.kids.size(), "Kids count");
+                image_node.level = toField(node.getLevel(), "Node level");
+                image_node.type = static_cast<std::uint8_t>(node.type);
+                for(std::size_t k = 0; k != node.kids.size(); ++k) {
+                    image_nodes[next_kid + k].parent = i;
+                }
+                next_kid += node.kids.size();
+                dense = dense && node.getId() == i;
+
+                if(char const* value = node.getDataIf<char>()) {
+                    image_node.payload = static_cast<std::uint64_t>(static_cast<std::int64_t>(*value));
+                }
+                else if(int const* value = node.getDataIf<int>()) {
+                    image_node.payload = static_cast<std::uint64_t>(static_cast<std::int64_t>(*value));
+                }
+                else if(long const* value = node.getDataIf<long>()) {
+                    image_node.payload = static_cast<std::uint64_t>(static_cast<std::int64_t>(*value));
+                }
+                else if(double const* value = node.getDataIf<double>()) {
+                    std::memcpy(&image_node.payload, value, sizeof(*value));
+                }
+                else if(std::string const* value = node.getDataIf<std::string>()) {
+                    image_node.payload = strings.size();
+                    image_node.length = toField(value->size(), "String length");
+                    strings += *value;
+                }
+            }
+
+            if(!dense) {
+                image_ids.reserve(order.size());
+                for(std::size_t i = 0; i != order.size(); ++i) {
+                    image_ids.push_back(ImageId{image_nodes[i].id, i});
+                }
+                std::sort(image_ids.begin(), image_ids.end(),
+                          [](ImageId const& a, ImageId const& b) { return a.id < b.id; });
+            }
+
+            // заголовок | узлы | таблица id | пул строк
+            ImageHeader image_header{{0}, static_cast<std::uint32_t>(IMAGE_VERSION), 0, order.size(), 0, 0, 0,
+                                     strings.size(), 0};
+            std::strncpy(image_header.magic, IMAGE_MAGIC_TAG, sizeof(image_header.magic));
+            image_header.nodes_offset = sizeof(ImageHeader);
+            image_header.ids_offset = dense ? 0 : image_header.nodes_offset + image_nodes.size() * sizeof(ImageNode);
+            image_header.pool_offset = image_header.nodes_offset + image_nodes.size() * sizeof(ImageNode) +
+                                       image_ids.size() * sizeof(ImageId);
+            image_header.image_size = image_header.pool_offset + strings.size();
+
+            std::vector<char> image(image_header.image_size);
+            std::memcpy(image.data(), &image_header, sizeof(image_header));
+            std::memcpy(image.data() + image_header.nodes_offset, image_nodes.data(),
+                        image_nodes.size() * sizeof(ImageNode));
+            if(!dense) {
+                std::memcpy(image.data() + image_header.ids_offset, image_ids.data(),
+                            image_ids.size() * sizeof(ImageId));
+            }
+            std::memcpy(image.data() + image_header.pool_offset, strings.data(), strings.size());
+
+            return image;
+        }
+        // Атомарно публикует образ дерева в файл: запись во временный файл рядом, fsync и rename.
+        // Аргументы:
+        // tree - дерево
+        // path - имя файла образа
+        static void publish(NaryTree& tree, std::string const& path)
+        {
+            std::vector<char> image = build(tree);
+            std::string temp_path = path + ".tmp." + std::to_string(::getpid());
+            int fd = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+            if(fd < 0) {
+                std::string msg = "Can't open file '" + temp_path + "' for writing";
+                throw std::runtime_error(msg);
+            }
+
+            std::size_t written = 0;
+            while(written != image.size()) {
+                ssize_t count = ::write(fd, image.data() + written, image.size() - written);
+                if(count <= 0) {
+                    break;
+                }
+                written += static_cast<std::size_t>(count);
+            }
+
+            bool ok = written == image.size() && ::fsync(fd) == 0;
+            ok = ::close(fd) == 0 && ok;
+            if(!ok || ::rename(temp_path.c_str(), path.c_str()) != 0) {
+                ::unlink(temp_path.c_str());
+                std::string msg = "Error while writing file '" + path + "'";
+                throw std::runtime_error(msg);
+            }
+        }
+        // Атомарно публикует образ дерева как объект POSIX shared memory (Linux: файл в /dev/shm).
+        // Аргументы:
+        // tree - дерево
+        // name - имя объекта ("/имя", как для shm_open)
+        static void publishShared(NaryTree& tree, std::string const& name)
+        {
+            publish(tree, "/dev/shm" + name);
+        }
+        // Удаляет объект POSIX shared memory (подключенные образы остаются действительными).
+        static void unlinkShared(std::string const& name) noexcept
+        {
+            ::shm_unlink(name.c_str());
+        }
+
+        // Подключение
+
+        // Отображает в память файл образа.
+        static TreeImage attach(std::string const& path)
+        {
+            int fd = ::open(path.c_str(), O_RDONLY);
+
+            if(fd < 0) {
+                std::string msg = "Can't open file '" + path + "' for reading";
+                throw std::runtime_error(msg);
+            }
+
+            return map(fd, path);
+        }
+        // Отображает в память объект POSIX shared memory с образом.
+        static TreeImage attachShared(std::string const& name)
+        {
+            int fd = ::shm_open(name.c_str(), O_RDONLY, 0);
+
+            if(fd < 0) {
+                std::string msg = "Can't open shared memory object '" + name + "' for reading";
+                throw std::runtime_error(msg);
+            }
+
+            return map(fd, name);
+        }
+
+        // Аксессоры
+        NodeView getRoot() const noexcept {
+            return NodeView(header, nodes);
+        }
+        // Возвращает узел по номеру в порядке обхода в ширину.
+        NodeView at(std::size_t index) const {
+            return nodeAt(header, index);
+        }
+        // Возвращает узел по его id (за O(1), если id совпадают с номерами узлов, иначе за O(log n)).
+        std::optional<NodeView> findNodeById(std::size_t id) const
+        {
+            if(!ids) {
+                return id < header->node_count ? std::make_optional(NodeView(header, nodes + id)) : std::nullopt;
+            }
+
+            ImageId const* end = ids + header->node_count;
+            ImageId const* found = std::lower_bound(ids, end, id,
+                                                    [](ImageId const& entry, std::size_t key) { return entry.id < key; });
+            if(found == end || found->id != id) {
+                return std::nullopt;
+            }
+            return at(found->index);
+        }
+        // Возвращает узлы в порядке обхода в ширину.
+        std::vector<NodeView> getNodesVector() const
+        {
+            std::vector<NodeView> vec;
+            vec.reserve(header->node_count);
+            for(std::size_t i = 0; i != header->node_count; ++i) {
+                vec.emplace_back(header, nodes + i);
+            }
+            return vec;
+        }
+
+        // Запросы
+        std::size_t size() const noexcept {
+            return header->node_count;
+        }
+        // Размер образа в байтах.
+        std::size_t imageSize() const noexcept {
+            return bytes;
+        }
+    };
+
+} // namespace sds
+
+#endif
@@ -5,7 +5,9 @@
 #define SDS_UTILITIES_HPP
 
 #include "nary_tree.hpp"
+#include "async_io.hpp"
 #include <fstream>
+#include <filesystem>
 
 namespace sds {
 
@@ -38,13 +40,14 @@ namespace sds {
         return tree;
     }
     // Загружает дерево из файла (обертка для открытия / закрытия файла).
+    // Чтение блокирующее: по nary_tree_bench чтение с опережением (AsyncReadBuf) не дает выигрыша
+    // на холодном page cache - разбор, а не диск, ограничивает загрузку.
     // Аргументы:
     // tree - дерево (подразумевается _пустое_ дерево)
     // in_file_name - имя файла
     void loadTreeFromFile(sds::NaryTree& tree, std::string const& in_file_name)
     {
-        std::ifstream in_file;
-        in_file.open(in_file_name);
+        std::ifstream in_file(in_file_name);
 
         if(!in_file) {
             std::string msg = "Can't open file '" + in_file_name + "' for reading";
@@ -52,25 +55,204 @@ namespace sds {
         }
 
         tree.loadTree(in_file);
-
-        in_file.close();
     }
     // Сохраняет дерево в файл (обертка для открытия / закрытия файла).
+    // Форматирование идет параллельно с записью фоновым потоком (см. AsyncWriteBuf).
     // Аргументы:
     // tree - дерево (подразумевается _пустое_ дерево)
     // out_file_name - имя файла
-    void saveTreeToFile(sds::NaryTree& tree, std::string const& out_file_name)
+    // with_index - записать рядом sidecar-индекс снимка (out_file_name + INDEX_EXT); без него
+    //              старый sidecar-индекс удаляется, чтобы не остался индекс от прежнего снимка
+    void saveTreeToFile(sds::NaryTree& tree, std::string const& out_file_name, bool with_index = false)
     {
-        std::ofstream out_file;
-        out_file.open(out_file_name, std::ios::trunc);
+        if(!with_index) {
+            std::error_code ignored;
+            std::filesystem::remove(out_file_name + INDEX_EXT, ignored);
+        }
 
-        if(!out_file) {
+        sds::AsyncWriteBuf out_buf(out_file_name);
+
+        if(!out_buf.isOpen()) {
             std::string msg = "Can't open file '" + out_file_name + "' for writing";
             throw std::runtime_error(msg);
         }
 
-        tree.saveTree(out_file);
-        out_file.close();
+        std::ostream out_file(&out_buf);
+
+        if(with_index) {
+            std::string index_file_name = out_file_name + INDEX_EXT;
+            std::ofstream index_file(index_file_name, std::ios::trunc);
+
+            if(!index_file) {
+                std::string msg = "Can't open file '" + index_file_name + "' for writing";
+                throw std::runtime_error(msg);
+            }
+
+            tree.saveTree(out_file, index_file);
+        }
+        else {
+            tree.saveTree(out_file);
+        }
+
+        out_buf.close();
+    }
+    // Строит sidecar-индекс для уже сохраненного снимка дерева (отдельный шаг индексации).
+    // Аргументы:
+    // file_name - имя файла снимка; индекс пишется в file_name + INDEX_EXT
+    void indexTreeFile(std::string const& file_name)
+    {
+        std::ifstream in_file(file_name);
+
+        if(!in_file) {
+            std::string msg = "Can't open file '" + file_name + "' for reading";
+            throw std::runtime_error(msg);
+        }
+
+        sds::SnapshotIndex index = sds::SnapshotIndex::build(in_file);
+
+        std::string index_file_name = file_name + INDEX_EXT;
+        std::ofstream index_file(index_file_name, std::ios::trunc);
+
+        if(!index_file) {
+            std::string msg = "Can't open file '" + index_file_name + "' for writing";
+            throw std::runtime_error(msg);
+        }
+
+        index.save(index_file);
+    }
+    // Загружает из файла только поддерево (см. NaryTree::loadSubtree). Если sidecar-индекса
+    // нет, он строится просмотром файла.
+    // Аргументы:
+    // tree - дерево (подразумевается _пустое_ дерево)
+    // in_file_name - имя файла
+    // root_id - id корня поддерева
+    // max_depth - максимальная глубина относительно корня поддерева
+    void loadSubtreeFromFile(sds::NaryTree& tree, std::string const& in_file_name, std::size_t root_id,
+                             std::size_t max_depth = std::numeric_limits<std::size_t>::max())
+    {
+        std::ifstream in_file(in_file_name);
+
+        if(!in_file) {
+            std::string msg = "Can't open file '" + in_file_name + "' for reading";
+            throw std::runtime_error(msg);
+        }
+
+        std::ifstream index_file(in_file_name + INDEX_EXT);
+
+        if(index_file) {
+            tree.loadSubtree(in_file, sds::SnapshotIndex::load(index_file), root_id, max_depth);
+        }
+        else {
+            tree.loadSubtree(in_file, root_id, max_depth);
+        }
+    }
+    // Сохраняет шарды (см. NaryTree::shard) в самостоятельные файлы prefix.<номер шарда> и манифест
+    // prefix + SHARDS_EXT с точками разреза. Формат строки манифеста (в псевдокоде):
+    // {parent shard} attach_id:position:count:root_id:file_name     ({root} для корневого шарда)
+    // Шард из count > 1 корней пишется без корня-заглушки: каждый корень с поддеревом - в свой файл
+    // file_name.<номер корня>, а файла file_name нет.
+    // Аргументы:
+    // shards - шарды
+    // prefix - путь и начало имен файлов
+    void saveShardsToFiles(std::vector<sds::Shard>& shards, std::string const& prefix)
+    {
+        std::string manifest_name = prefix + SHARDS_EXT;
+        std::ofstream manifest(manifest_name, std::ios::trunc);
+
+        if(!manifest) {
+            std::string msg = "Can't open file '" + manifest_name + "' for writing";
+            throw std::runtime_error(msg);
+        }
+
+        manifest << SHARDS_MAGIC_TAG << DELIM << SHARDS_VERSION << EOL;
+        for(std::size_t s = 0; s != shards.size(); ++s) {
+            std::string file_name = prefix + "." + std::to_string(s);
+            if(shards[s].count == 1) {
+                saveTreeToFile(shards[s].tree, file_name);
+            }
+            else {
+                for(std::size_t j = 0; j != shards[s].count; ++j) {
+                    sds::NaryTree run_root = shards[s].tree.extractSubtree(shards[s].tree.findNodeById(j + 1));
+                    saveTreeToFile(run_root, file_name + "." + std::to_string(j));
+                }
+            }
+
+            manifest << "{";
+            if(shards[s].parent_shard) {
+                manifest << *shards[s].parent_shard;
+            }
+            else {
+                manifest << ROOT_STR;
+            }
+            manifest << "} " << shards[s].attach_id << DELIM << shards[s].position << DELIM << shards[s].count
+                     << DELIM << shards[s].root_id << DELIM << std::filesystem::path(file_name).filename().string() << EOL;
+        }
+
+        if(!manifest) {
+            std::string msg = "Error while writing file '" + manifest_name + "'";
+            throw std::runtime_error(msg);
+        }
+    }
+    // Загружает шарды по манифесту (файлы ищутся рядом с ним) и сшивает их в одно дерево.
+    // Аргументы:
+    // manifest_name - имя файла манифеста
+    // Возвращает:
+    // sds::NaryTree - сшитое дерево
+    sds::NaryTree mergeShardsFromFiles(std::string const& manifest_name)
+    {
+        std::ifstream manifest(manifest_name);
+
+        if(!manifest) {
+            std::string msg = "Can't open file '" + manifest_name + "' for reading";
+            throw std::runtime_error(msg);
+        }
+
+        std::string line;
+        if(!std::getline(manifest, line, EOL) ||
+           line != std::string(SHARDS_MAGIC_TAG) + DELIM + std::to_string(SHARDS_VERSION)) {
+            throw DeserialisationException("Wrong shards manifest format");
+        }
+
+        std::filesystem::path directory = std::filesystem::path(manifest_name).parent_path();
+        std::vector<sds::Shard> shards;
+
+        while(std::getline(manifest, line, EOL)) {
+            std::size_t close = line.find("} ");
+            if(line.empty() || line[0] != '{' || close == std::string::npos) {
+                throw DeserialisationException("Malformed shards manifest line: '" + line + "'");
+            }
+
+            std::string parent = line.substr(1, close - 1);
+            std::istringstream iss(line.substr(close + 2));
+            sds::Shard shard{sds::NaryTree(), 0, std::nullopt, 0, 0, 1};
+            char delim1, delim2, delim3, delim4;
+            std::string file_name;
+
+            if(!(iss >> shard.attach_id >> delim1 >> shard.position >> delim2 >> shard.count
+                     >> delim3 >> shard.root_id >> delim4) ||
+               delim1 != DELIM || delim2 != DELIM || delim3 != DELIM || delim4 != DELIM ||
+               !shard.count || !std::getline(iss, file_name) || file_name.empty()) {
+                throw DeserialisationException("Malformed shards manifest line: '" + line + "'");
+            }
+            if(parent != ROOT_STR) {
+                shard.parent_shard = std::stoul(parent);
+            }
+
+            std::string path = (directory / file_name).string();
+            if(shard.count == 1) {
+                loadTreeFromFile(shard.tree, path);
+            }
+            else {
+                std::vector<sds::NaryTree> roots(shard.count);
+                for(std::size_t j = 0; j != shard.count; ++j) {
+                    loadTreeFromFile(roots[j], path + "." + std::to_string(j));
+                }
+                shard.tree = sds::NaryTree::joinRun(std::move(roots));
+            }
+            shards.push_back(std::move(shard));
+        }
+
+        return sds::NaryTree::merge(std::move(shards));
     }
 
 } // namespace sds